@@ -0,0 +1,558 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * animation.c: animated backgrounds (APNG). The frames are decoded,
+ *              composited and prepared (see images_apply_effects()) by a
+ *              low-priority thread, ahead of the timer in i3lock.c which
+ *              presents them. If all frames fit into --prefetch-memory, they
+ *              are decoded once and kept. Otherwise, they are streamed through
+ *              a ring of a few frames and decoded again on every loop.
+ *
+ *              cairo can only decode plain PNG images, so every frame is
+ *              turned into one: the IHDR (with the size of the frame), the
+ *              chunks which apply to all frames (e.g. PLTE) and the frame’s
+ *              data as IDAT.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cairo.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "animation.h"
+#include "images.h"
+
+/* Upper limit for the number of frames decoded ahead when streaming. */
+#define RING_SIZE_MAX 16
+
+enum {
+    DISPOSE_NONE = 0,
+    DISPOSE_BACKGROUND = 1,
+    DISPOSE_PREVIOUS = 2
+};
+
+enum {
+    BLEND_SOURCE = 0,
+    BLEND_OVER = 1
+};
+
+extern bool debug_mode;
+
+static const unsigned char png_signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+typedef struct {
+    /* From the fcTL chunk. */
+    uint32_t width, height;
+    uint32_t x, y;
+    double delay;
+    uint8_t dispose_op;
+    uint8_t blend_op;
+    /* The compressed image data (from IDAT or fdAT chunks). */
+    unsigned char *data;
+    size_t len;
+} frame_info_t;
+
+static char *path;
+static uint32_t canvas_width, canvas_height;
+static unsigned char ihdr[13];
+/* Chunks which apply to all frames (e.g. PLTE, tRNS), as they are in the
+ * file. */
+static unsigned char *shared_chunks;
+static size_t shared_len;
+static frame_info_t *frames;
+static int num_frames;
+/* How often the animation is played, 0 = forever. */
+static uint32_t num_plays;
+
+/* Only used by the thread, see render_frame(). */
+static cairo_surface_t *canvas;
+static cairo_surface_t *saved_canvas;
+
+typedef struct {
+    cairo_surface_t *surface;
+    double scale;
+    double delay;
+} decoded_frame_t;
+
+/* Everything below is protected by ring_lock. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+/* Whether all frames are kept, in which case ring[i] is frame i. */
+static bool keep_all;
+static decoded_frame_t *ring;
+static int ring_size;
+static int ring_head;
+static int ring_len;
+static bool thread_done;
+static struct ev_loop *ready_loop;
+static struct ev_async *ready_watcher;
+
+static animation_ready_callback_t ready_callback;
+
+/* Only used by the main thread, see animation_next_frame(). */
+static int shown = -1;
+static uint32_t plays;
+static cairo_surface_t *current;
+static bool done;
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc(uint32_t c, const unsigned char *buf, size_t len) {
+    for (size_t n = 0; n < len; n++)
+        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t read_u32(const unsigned char *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static uint16_t read_u16(const unsigned char *buf) {
+    return (buf[0] << 8) | buf[1];
+}
+
+static void write_u32(unsigned char *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+/*
+ * Writes a chunk with the given type and data to buf, which must have room
+ * for len + 12 bytes. Returns the number of bytes written.
+ *
+ */
+static size_t write_chunk(unsigned char *buf, const char *type, const unsigned char *data, size_t len) {
+    write_u32(buf, len);
+    memcpy(buf + 4, type, 4);
+    if (len > 0)
+        memcpy(buf + 8, data, len);
+    write_u32(buf + 8 + len, crc(0xffffffff, buf + 4, len + 4) ^ 0xffffffff);
+    return len + 12;
+}
+
+static void append(unsigned char **buf, size_t *buf_len, const unsigned char *data, size_t len) {
+    *buf = realloc(*buf, *buf_len + len);
+    if (*buf == NULL)
+        err(EXIT_FAILURE, "realloc");
+    memcpy(*buf + *buf_len, data, len);
+    *buf_len += len;
+}
+
+/*
+ * Splits the given APNG file into its frames. Returns false if it is not an
+ * APNG (or not a valid one).
+ *
+ */
+static bool parse(const unsigned char *buf, size_t len) {
+    bool animated = false;
+    bool seen_idat = false;
+    size_t pos = sizeof(png_signature);
+
+    if (len < pos || memcmp(buf, png_signature, sizeof(png_signature)) != 0)
+        return false;
+
+    while (pos + 12 <= len) {
+        uint32_t chunk_len = read_u32(buf + pos);
+        const unsigned char *type = buf + pos + 4;
+        const unsigned char *data = buf + pos + 8;
+        if (chunk_len > len - pos - 12)
+            return false;
+
+        if (memcmp(type, "IHDR", 4) == 0 && chunk_len == sizeof(ihdr)) {
+            memcpy(ihdr, data, sizeof(ihdr));
+            canvas_width = read_u32(data);
+            canvas_height = read_u32(data + 4);
+        } else if (memcmp(type, "acTL", 4) == 0 && chunk_len == 8) {
+            animated = true;
+            num_plays = read_u32(data + 4);
+        } else if (memcmp(type, "fcTL", 4) == 0 && chunk_len == 26) {
+            frames = realloc(frames, sizeof(frame_info_t) * (num_frames + 1));
+            if (frames == NULL)
+                err(EXIT_FAILURE, "realloc");
+            frame_info_t *frame = &frames[num_frames++];
+            memset(frame, 0, sizeof(frame_info_t));
+            frame->width = read_u32(data + 4);
+            frame->height = read_u32(data + 8);
+            frame->x = read_u32(data + 12);
+            frame->y = read_u32(data + 16);
+            uint16_t delay_num = read_u16(data + 20);
+            uint16_t delay_den = read_u16(data + 22);
+            frame->delay = (double)delay_num / (delay_den != 0 ? delay_den : 100);
+            /* Like browsers do, treat (almost) no delay as the default. */
+            if (frame->delay <= 0.01)
+                frame->delay = 0.1;
+            frame->dispose_op = data[24];
+            frame->blend_op = data[25];
+            if (frame->width == 0 || frame->height == 0 ||
+                frame->x > canvas_width || frame->width > canvas_width - frame->x ||
+                frame->y > canvas_height || frame->height > canvas_height - frame->y)
+                return false;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            /* Only part of the animation if preceded by a fcTL chunk,
+             * otherwise it is the image shown by other decoders. */
+            if (num_frames == 1)
+                append(&frames[0].data, &frames[0].len, data, chunk_len);
+            seen_idat = true;
+        } else if (memcmp(type, "fdAT", 4) == 0 && chunk_len > 4) {
+            if (num_frames > 0)
+                append(&frames[num_frames - 1].data, &frames[num_frames - 1].len, data + 4, chunk_len - 4);
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        } else if (!seen_idat) {
+            append(&shared_chunks, &shared_len, buf + pos, chunk_len + 12);
+        }
+
+        pos += chunk_len + 12;
+    }
+
+    if (!animated || num_frames < 2)
+        return false;
+    for (int i = 0; i < num_frames; i++)
+        if (frames[i].data == NULL)
+            return false;
+    return true;
+}
+
+/*
+ * Reads the given image. Returns true if it is animated, in which case
+ * animation_start() should be called.
+ *
+ */
+bool animation_open(const char *image_path) {
+    FILE *file = fopen(image_path, "r");
+    if (file == NULL)
+        return false;
+
+    unsigned char *buf = NULL;
+    size_t len = 0;
+    unsigned char block[65536];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+        append(&buf, &len, block, n);
+    fclose(file);
+
+    init_crc_table();
+    bool animated = parse(buf, len);
+    free(buf);
+
+    if (!animated) {
+        for (int i = 0; i < num_frames; i++)
+            free(frames[i].data);
+        free(frames);
+        frames = NULL;
+        num_frames = 0;
+        return false;
+    }
+
+    path = strdup(image_path);
+    DEBUG("\"%s\" is animated, %d frames of %ux%u\n", path, num_frames, canvas_width, canvas_height);
+    return true;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} png_reader_t;
+
+static cairo_status_t read_png(void *closure, unsigned char *data, unsigned int length) {
+    png_reader_t *reader = closure;
+    if (length > reader->len - reader->pos)
+        return CAIRO_STATUS_READ_ERROR;
+    memcpy(data, reader->data + reader->pos, length);
+    reader->pos += length;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+/*
+ * Decodes the given frame into an image of the frame’s size.
+ *
+ */
+static cairo_surface_t *decode_frame(const frame_info_t *frame) {
+    size_t len = sizeof(png_signature) + (sizeof(ihdr) + 12) + shared_len + (frame->len + 12) + 12;
+    unsigned char *png = malloc(len);
+    if (png == NULL)
+        err(EXIT_FAILURE, "malloc");
+
+    unsigned char frame_ihdr[sizeof(ihdr)];
+    memcpy(frame_ihdr, ihdr, sizeof(ihdr));
+    write_u32(frame_ihdr, frame->width);
+    write_u32(frame_ihdr + 4, frame->height);
+
+    size_t pos = 0;
+    memcpy(png, png_signature, sizeof(png_signature));
+    pos += sizeof(png_signature);
+    pos += write_chunk(png + pos, "IHDR", frame_ihdr, sizeof(frame_ihdr));
+    memcpy(png + pos, shared_chunks, shared_len);
+    pos += shared_len;
+    pos += write_chunk(png + pos, "IDAT", frame->data, frame->len);
+    pos += write_chunk(png + pos, "IEND", NULL, 0);
+
+    png_reader_t reader = {png, pos, 0};
+    cairo_surface_t *img = cairo_image_surface_create_from_png_stream(read_png, &reader);
+    free(png);
+
+    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not decode a frame of \"%s\": %s\n",
+                path, cairo_status_to_string(cairo_surface_status(img)));
+        cairo_surface_destroy(img);
+        return NULL;
+    }
+    return img;
+}
+
+static cairo_surface_t *copy_surface(cairo_surface_t *source) {
+    cairo_surface_t *copy = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
+    cairo_t *cr = cairo_create(copy);
+    cairo_set_source_surface(cr, source, 0, 0);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    return copy;
+}
+
+/*
+ * Composites the given frame onto the canvas (following the dispose and blend
+ * operations) and returns a prepared copy of the canvas, or NULL if the frame
+ * cannot be decoded. Frames must be rendered in order, starting at 0.
+ *
+ */
+static cairo_surface_t *render_frame(int index, double *scale) {
+    const frame_info_t *frame = &frames[index];
+
+    if (canvas == NULL)
+        canvas = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, canvas_width, canvas_height);
+
+    cairo_t *cr = cairo_create(canvas);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    if (index == 0) {
+        cairo_paint(cr);
+    } else {
+        const frame_info_t *previous = &frames[index - 1];
+        if (previous->dispose_op == DISPOSE_PREVIOUS && saved_canvas != NULL) {
+            cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+            cairo_set_source_surface(cr, saved_canvas, 0, 0);
+            cairo_paint(cr);
+        } else if (previous->dispose_op != DISPOSE_NONE) {
+            /* DISPOSE_PREVIOUS on the first frame is treated like
+             * DISPOSE_BACKGROUND. */
+            cairo_rectangle(cr, previous->x, previous->y, previous->width, previous->height);
+            cairo_fill(cr);
+        }
+    }
+
+    if (saved_canvas != NULL) {
+        cairo_surface_destroy(saved_canvas);
+        saved_canvas = NULL;
+    }
+    if (frame->dispose_op == DISPOSE_PREVIOUS && index > 0) {
+        cairo_surface_flush(canvas);
+        saved_canvas = copy_surface(canvas);
+    }
+
+    cairo_surface_t *img = decode_frame(frame);
+    if (img == NULL) {
+        cairo_destroy(cr);
+        return NULL;
+    }
+
+    cairo_rectangle(cr, frame->x, frame->y, frame->width, frame->height);
+    cairo_clip(cr);
+    cairo_set_operator(cr, (frame->blend_op == BLEND_SOURCE ? CAIRO_OPERATOR_SOURCE : CAIRO_OPERATOR_OVER));
+    cairo_set_source_surface(cr, img, frame->x, frame->y);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(img);
+
+    cairo_surface_flush(canvas);
+    return images_apply_effects(copy_surface(canvas), path, scale);
+}
+
+static void *decode_thread(void *arg) {
+    int index = 0;
+    uint32_t decoded_plays = 0;
+
+    images_lower_priority();
+
+    for (;;) {
+        pthread_mutex_lock(&ring_lock);
+        while (!keep_all && ring_len == ring_size)
+            pthread_cond_wait(&ring_cond, &ring_lock);
+        pthread_mutex_unlock(&ring_lock);
+
+        decoded_frame_t decoded;
+        decoded.delay = frames[index].delay;
+        decoded.surface = render_frame(index, &decoded.scale);
+        if (decoded.surface == NULL)
+            break;
+
+        pthread_mutex_lock(&ring_lock);
+        ring[keep_all ? index : (ring_head + ring_len) % ring_size] = decoded;
+        ring_len++;
+        if (ready_watcher != NULL)
+            ev_async_send(ready_loop, ready_watcher);
+        pthread_mutex_unlock(&ring_lock);
+
+        if (++index == num_frames) {
+            index = 0;
+            if (keep_all || (num_plays > 0 && ++decoded_plays >= num_plays))
+                break;
+        }
+    }
+
+    if (canvas != NULL) {
+        cairo_surface_destroy(canvas);
+        canvas = NULL;
+    }
+    pthread_mutex_lock(&ring_lock);
+    thread_done = true;
+    if (ready_watcher != NULL)
+        ev_async_send(ready_loop, ready_watcher);
+    pthread_mutex_unlock(&ring_lock);
+    DEBUG("animation decoding thread done\n");
+    return NULL;
+}
+
+/*
+ * Starts decoding the frames of the animation opened with animation_open().
+ * If all frames fit into the given budget (in bytes), they are decoded once
+ * and kept. max_frame_bytes is the --max-image-memory limit (0 = none).
+ *
+ */
+void animation_start(size_t budget, size_t max_frame_bytes) {
+    size_t frame_bytes = (size_t)canvas_width * canvas_height * 4;
+    if (max_frame_bytes > 0 && frame_bytes > max_frame_bytes)
+        frame_bytes = max_frame_bytes;
+
+    keep_all = (frame_bytes * num_frames <= budget);
+    if (keep_all) {
+        ring_size = num_frames;
+    } else {
+        ring_size = budget / frame_bytes;
+        if (ring_size < 2)
+            ring_size = 2;
+        if (ring_size > RING_SIZE_MAX)
+            ring_size = RING_SIZE_MAX;
+    }
+    DEBUG("animation needs %zu KiB per frame, %s (%d frames)\n", frame_bytes / 1024,
+          (keep_all ? "keeping all frames" : "streaming"), ring_size);
+
+    ring = calloc(sizeof(decoded_frame_t), ring_size);
+    if (ring == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, decode_thread, NULL);
+    if (error != 0)
+        errx(EXIT_FAILURE, "Could not start the animation thread: %s", strerror(error));
+    pthread_detach(thread);
+}
+
+/*
+ * Returns the next frame and stores its scale (see images_apply_effects())
+ * and how long it should be shown. Returns NULL if the next frame is not
+ * decoded yet, or if the animation is over (see animation_done()). The frame
+ * stays valid until the next call.
+ *
+ */
+cairo_surface_t *animation_next_frame(double *scale, double *delay) {
+    if (done)
+        return NULL;
+
+    pthread_mutex_lock(&ring_lock);
+    int available = ring_len;
+    bool finished = thread_done;
+
+    if (!keep_all) {
+        if (available == 0) {
+            pthread_mutex_unlock(&ring_lock);
+            done = finished;
+            return NULL;
+        }
+        decoded_frame_t next = ring[ring_head];
+        ring_head = (ring_head + 1) % ring_size;
+        ring_len--;
+        pthread_cond_signal(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+
+        if (current != NULL)
+            cairo_surface_destroy(current);
+        /* In case it was decoded before the format was known. */
+        current = images_convert(next.surface);
+        *scale = next.scale;
+        *delay = next.delay;
+        return current;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    /* All frames are kept, the ones before ring_len never change. */
+    int next = shown + 1;
+    if (next >= available) {
+        if (!finished)
+            return NULL;
+        if (available == 0 || (num_plays > 0 && ++plays >= num_plays)) {
+            done = true;
+            return NULL;
+        }
+        next = 0;
+    }
+    shown = next;
+    /* Frames decoded before the format was known are converted once. */
+    ring[next].surface = images_convert(ring[next].surface);
+    *scale = ring[next].scale;
+    *delay = ring[next].delay;
+    return ring[next].surface;
+}
+
+/*
+ * Whether the animation is over, i.e. it was played as often as the file
+ * says, or decoding failed.
+ *
+ */
+bool animation_done(void) {
+    return done;
+}
+
+static void ready_cb(EV_P_ ev_async *w, int revents) {
+    ready_callback();
+}
+
+/*
+ * Calls the given callback from the event loop whenever a frame was decoded
+ * (or decoding is over), so that a frame which was not ready in time is shown
+ * as soon as it is.
+ *
+ */
+void animation_watch(struct ev_loop *loop, animation_ready_callback_t callback) {
+    ready_callback = callback;
+
+    struct ev_async *watcher = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(watcher, ready_cb);
+    ev_async_start(loop, watcher);
+
+    pthread_mutex_lock(&ring_lock);
+    ready_loop = loop;
+    ready_watcher = watcher;
+    pthread_mutex_unlock(&ring_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef _ANIMATION_H
+#define _ANIMATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <cairo.h>
+#include <ev.h>
+
+typedef void (*animation_ready_callback_t)(void);
+
+bool animation_open(const char *path);
+void animation_start(size_t budget, size_t max_frame_bytes);
+cairo_surface_t *animation_next_frame(double *scale, double *delay);
+bool animation_done(void);
+void animation_watch(struct ev_loop *loop, animation_ready_callback_t callback);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * auth.c: runs PAM in a separate, pre-forked helper process. The helper
+ *         calls pam_start() right away (so the PAM stack is loaded before
+ *         the first unlock attempt) and then waits for passwords on a
+ *         socketpair, answering each one with a single result byte. This
+ *         way, PAM module code never runs in the address space of the
+ *         process talking to X11, and verifying a password never blocks
+ *         the event loop.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <security/pam_appl.h>
+
+#include "i3lock.h"
+#include "auth.h"
+#include "notify.h"
+#include "timing.h"
+
+extern bool debug_mode;
+
+/* The user to authenticate, needed when re-spawning the helper. */
+static char *helper_username;
+
+/* The UI process’s end of the socketpair, or -1 if there is no helper. */
+static int helper_fd = -1;
+static pid_t helper_pid = -1;
+
+/* Whether the helper announced that PAM is initialized. A freshly spawned
+ * helper does so before sending the first result. */
+static bool helper_ready = false;
+
+/* When the password currently being verified was sent to the helper. */
+static double attempt_start;
+
+/* Histogram of authentication latencies. Bucket i counts the attempts which
+ * took less than 2^i milliseconds, the last bucket counts everything slower.
+ * Attempts which were cancelled because of --auth-timeout are counted
+ * separately. */
+#define LATENCY_BUCKETS 18
+static unsigned int latency_histogram[LATENCY_BUCKETS];
+static unsigned int latency_timeouts;
+
+/* Holds the password to verify (in UTF-8). Only used in the helper process. */
+static char password[512];
+
+/*
+ * Clears the memory which stored the password to be a bit safer against
+ * cold-boot attacks.
+ *
+ */
+static void clear_password_memory(void) {
+    /* A volatile pointer to the password buffer to prevent the compiler from
+     * optimizing this out. */
+    volatile char *vpassword = password;
+    for (size_t c = 0; c < sizeof(password); c++)
+        vpassword[c] = (char)c;
+}
+
+/*
+ * Callback function for PAM. We only react on password request callbacks.
+ *
+ */
+static int conv_callback(int num_msg, const struct pam_message **msg,
+                         struct pam_response **resp, void *appdata_ptr) {
+    if (num_msg == 0)
+        return 1;
+
+    /* PAM expects an array of responses, one for each message */
+    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int c = 0; c < num_msg; c++) {
+        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        /* return code is currently not used but should be set to zero */
+        resp[c]->resp_retcode = 0;
+        if ((resp[c]->resp = strdup(password)) == NULL) {
+            perror("strdup");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sends a single status byte to the other end of the socketpair.
+ *
+ */
+static bool send_byte(int fd, unsigned char byte) {
+    ssize_t n;
+    do {
+        n = send(fd, &byte, sizeof(byte), MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return (n == sizeof(byte));
+}
+
+/*
+ * Main function of the helper process. Initializes PAM, reports readiness to
+ * the UI process and then verifies one password per received message until
+ * the UI process goes away.
+ *
+ */
+static void helper_main(int fd, const char *username) {
+    pam_handle_t *pam_handle;
+    struct pam_conv conv = {conv_callback, NULL};
+    int ret;
+
+#if defined(__linux__)
+    /* See the comment in main(): we don’t want the password to be swapped to
+     * disk in the helper either. */
+    if (mlock(password, sizeof(password)) != 0)
+        err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
+#endif
+
+    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+    /* Most PAM modules look up the user first. Doing that now loads the NSS
+     * modules, so that the first attempt is not slower than the following
+     * ones. */
+    (void)getpwnam(username);
+
+    if (!send_byte(fd, AUTH_RESULT_SUCCESS))
+        exit(EXIT_FAILURE);
+
+    while (true) {
+        ssize_t n = recv(fd, password, sizeof(password), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* The UI process exited (or crashed), so do we. */
+            clear_password_memory();
+            pam_end(pam_handle, PAM_SUCCESS);
+            exit(EXIT_SUCCESS);
+        }
+        /* The UI process sends the terminating NUL byte, but better be sure. */
+        password[n - 1] = '\0';
+
+        ret = pam_authenticate(pam_handle, 0);
+        clear_password_memory();
+
+        if (ret == PAM_SUCCESS) {
+            /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
+             * Related to credentials pam_end() needs to be called to cleanup any temporary
+             * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
+             * refresh of the credentials failed. */
+            pam_setcred(pam_handle, PAM_REFRESH_CRED);
+            pam_end(pam_handle, PAM_SUCCESS);
+
+            if (!send_byte(fd, AUTH_RESULT_SUCCESS))
+                exit(EXIT_SUCCESS);
+
+            /* In --daemon mode, the UI process stays around for the next
+             * lock, so prepare a fresh PAM handle for it. Otherwise, the UI
+             * process exits and we notice that in recv() above. */
+            if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
+                errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+            if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
+                errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+            continue;
+        }
+
+        if (!send_byte(fd, AUTH_RESULT_FAILURE)) {
+            pam_end(pam_handle, ret);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Closes every file descriptor above stderr except keep. A helper which is
+ * re-spawned after a crash is forked from the fully set up UI process, so it
+ * would otherwise inherit the X11 connections, the IPC socket and the event
+ * loop’s descriptors, and keep them open for as long as it runs.
+ *
+ */
+static void close_inherited_fds(int keep) {
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max == -1)
+        max = 1024;
+    for (int fd = STDERR_FILENO + 1; fd < max; fd++) {
+        if (fd != keep)
+            close(fd);
+    }
+}
+
+/*
+ * Forks a new helper process.
+ *
+ */
+static bool spawn_helper(void) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("socketpair");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        /* Child */
+        /* Otherwise the sleep lock of xss-lock would be held until the
+         * helper exits. */
+        notify_release();
+        close_inherited_fds(fds[1]);
+        helper_main(fds[1], helper_username);
+        exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    helper_fd = fds[0];
+    helper_pid = pid;
+    helper_ready = false;
+    DEBUG("started authentication helper, pid %d\n", (int)pid);
+    return true;
+}
+
+/*
+ * Closes our end of the socketpair and reaps the helper, which exits as soon
+ * as it notices.
+ *
+ */
+static void reap_helper(void) {
+    close(helper_fd);
+    helper_fd = -1;
+    if (helper_pid != -1) {
+        waitpid(helper_pid, NULL, 0);
+        helper_pid = -1;
+    }
+}
+
+/*
+ * Forks the authentication helper. Returns false if the helper could not be
+ * started, in which case there is no way to unlock the screen.
+ *
+ */
+bool auth_helper_start(const char *username) {
+    if ((helper_username = strdup(username)) == NULL)
+        return false;
+    return spawn_helper();
+}
+
+/*
+ * Returns the milliseconds which passed since the current attempt started.
+ *
+ */
+static double attempt_duration_ms(void) {
+    return now_ms() - attempt_start;
+}
+
+/*
+ * Adds the duration of a finished attempt to the latency histogram.
+ *
+ */
+static void record_latency(double ms) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ms >= (double)(1 << bucket))
+        bucket++;
+    latency_histogram[bucket]++;
+}
+
+/*
+ * Blocks until the helper reports that PAM is initialized. Returns false if
+ * the helper exited instead (it already printed why).
+ *
+ */
+bool auth_helper_wait_ready(void) {
+    auth_result_t result;
+    unsigned char byte;
+    ssize_t n;
+
+    do {
+        n = recv(helper_fd, &byte, sizeof(byte), 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != sizeof(byte))
+        return false;
+
+    result = byte;
+    helper_ready = (result == AUTH_RESULT_SUCCESS);
+    return helper_ready;
+}
+
+/*
+ * Returns the file descriptor to watch for authentication results.
+ *
+ */
+int auth_helper_fd(void) {
+    return helper_fd;
+}
+
+/*
+ * Hands the given password (len bytes, plus the terminating NUL byte) to the
+ * helper, re-spawning it first if it died. The result can be read with
+ * auth_helper_read_result() as soon as auth_helper_fd() becomes readable.
+ *
+ */
+bool auth_helper_send(const char *password, size_t len) {
+    ssize_t n;
+
+    if (helper_fd == -1 && !spawn_helper())
+        return false;
+
+    attempt_start = now_ms();
+    do {
+        n = send(helper_fd, password, len + 1, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return (n == (ssize_t)(len + 1));
+}
+
+/*
+ * Reads the result of the last verification without blocking. Returns false
+ * if no result is available yet.
+ *
+ */
+bool auth_helper_read_result(auth_result_t *result) {
+    unsigned char byte;
+    ssize_t n;
+
+    do {
+        n = recv(helper_fd, &byte, sizeof(byte), MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return false;
+
+    if (n != sizeof(byte)) {
+        fprintf(stderr, "[i3lock] authentication helper died, re-spawning it\n");
+        reap_helper();
+        *result = AUTH_RESULT_ERROR;
+        return true;
+    }
+
+    if (!helper_ready) {
+        helper_ready = true;
+        return false;
+    }
+
+    double ms = attempt_duration_ms();
+    record_latency(ms);
+    DEBUG("authentication took %.1f ms\n", ms);
+
+    *result = byte;
+    return true;
+}
+
+/*
+ * Abandons the attempt which is currently being verified: the helper (which
+ * is probably stuck in a PAM module waiting for the network) gets killed and
+ * a new one is spawned right away, so that it is ready for the next attempt.
+ *
+ */
+void auth_helper_cancel(void) {
+    double ms = attempt_duration_ms();
+    latency_timeouts++;
+    fprintf(stderr, "[i3lock] authentication timed out after %.1f ms, restarting the helper\n", ms);
+
+    if (helper_pid != -1)
+        kill(helper_pid, SIGKILL);
+    reap_helper();
+    (void)spawn_helper();
+}
+
+/*
+ * Prints the latency histogram, one line per non-empty bucket.
+ *
+ */
+void auth_latency_dump(FILE *stream) {
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if (latency_histogram[bucket] == 0)
+            continue;
+        if (bucket == LATENCY_BUCKETS - 1)
+            fprintf(stream, "auth latency >= %6d ms: %u\n", 1 << (bucket - 1), latency_histogram[bucket]);
+        else
+            fprintf(stream, "auth latency  < %6d ms: %u\n", 1 << bucket, latency_histogram[bucket]);
+    }
+    if (latency_timeouts > 0)
+        fprintf(stream, "auth timeouts: %u\n", latency_timeouts);
+}
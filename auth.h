@@ -0,0 +1,22 @@
+#ifndef _AUTH_H
+#define _AUTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+    AUTH_RESULT_SUCCESS = 0, /* the password was accepted by PAM */
+    AUTH_RESULT_FAILURE = 1, /* the password was rejected by PAM */
+    AUTH_RESULT_ERROR = 2    /* the helper died, it will be re-spawned */
+} auth_result_t;
+
+bool auth_helper_start(const char *username);
+bool auth_helper_wait_ready(void);
+int auth_helper_fd(void);
+bool auth_helper_send(const char *password, size_t len);
+bool auth_helper_read_result(auth_result_t *result);
+void auth_helper_cancel(void);
+void auth_latency_dump(FILE *stream);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * harden.c: --hardened keeps what is needed to handle a keystroke (the
+ *           stack, the heap, the keymap and compose tables, the code)
+ *           resident, so that the first keystroke after a suspend does not
+ *           wait for pages to be read back from swap or disk.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "i3lock.h"
+#include "harden.h"
+
+/* How much of the stack is faulted in ahead of time. Handling a key press
+ * (including cairo and xkbcommon) stays well below this. */
+#define STACK_PREFAULT (256 * 1024)
+
+/* Freed memory up to this size stays in the heap instead of being returned
+ * to the kernel, so that it does not have to be faulted in again. */
+#define HEAP_RETAIN (32 * 1024 * 1024)
+
+extern bool debug_mode;
+
+/*
+ * Must be called before allocating anything big: keeps buffers which are
+ * allocated on every redraw (e.g. the unlock indicator surface) in the heap,
+ * where they stay locked once harden_lock_memory() was called.
+ *
+ * Also makes all threads share one malloc arena: every other arena reserves
+ * 64 MiB of address space, which harden_lock_memory() checks against the
+ * budget. With the render, image prefetch and animation threads, that would
+ * be most of the default budget.
+ *
+ */
+void harden_init(void) {
+#if defined(__GLIBC__)
+    mallopt(M_MMAP_THRESHOLD, HEAP_RETAIN);
+    mallopt(M_TRIM_THRESHOLD, HEAP_RETAIN);
+    mallopt(M_ARENA_MAX, 1);
+#endif
+}
+
+/*
+ * Touches STACK_PREFAULT bytes of stack below the caller (in the calling
+ * thread), so that these pages exist (and are locked by harden_lock_memory())
+ * before they are needed.
+ *
+ */
+void harden_prefault_stack(void) {
+    volatile char stack[STACK_PREFAULT];
+    const long page_size = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < sizeof(stack); i += page_size)
+        stack[i] = 0;
+}
+
+/*
+ * Reads the size of our address space (in bytes) from /proc. Returns 0 if it
+ * is not known.
+ *
+ */
+static size_t address_space_size(void) {
+    FILE *file = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0;
+
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "%lu", &pages) != 1)
+        pages = 0;
+    fclose(file);
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Locks our memory, unless that needs more than budget bytes of
+ * RLIMIT_MEMLOCK. Where supported, only pages which are resident (or become
+ * resident later) are locked, instead of reading in everything that is
+ * mapped. Returns false (after printing why) on failure, in which case only
+ * the password buffers stay locked.
+ *
+ */
+bool harden_lock_memory(size_t budget) {
+    struct rlimit limit;
+
+    /* mlockall() checks the whole address space against the limit. */
+    size_t needed = address_space_size();
+    if (needed > budget) {
+        fprintf(stderr, "[i3lock] --hardened: need %zu MiB to lock our memory, more than the budget of %zu MiB\n",
+                needed / (1024 * 1024), budget / (1024 * 1024));
+        return false;
+    }
+
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < budget) {
+        limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > budget ? budget : limit.rlim_max);
+        (void)setrlimit(RLIMIT_MEMLOCK, &limit);
+    }
+
+#if defined(MCL_ONFAULT)
+    int flags = MCL_CURRENT | MCL_ONFAULT;
+#else
+    int flags = MCL_CURRENT;
+#endif
+    if (mlockall(flags) != 0) {
+        fprintf(stderr, "[i3lock] --hardened: could not lock %zu MiB: %s, check RLIMIT_MEMLOCK\n",
+                needed / (1024 * 1024), strerror(errno));
+        return false;
+    }
+
+    DEBUG("locked our memory (%zu MiB address space)\n", needed / (1024 * 1024));
+    return true;
+}
+
+/*
+ * Raises the scheduling priority of the calling thread (on Linux, the nice
+ * value is per thread), i.e. of the main thread, which handles input, or of
+ * the render thread. Needs CAP_SYS_NICE or a sufficient RLIMIT_NICE,
+ * otherwise we keep the current priority.
+ *
+ */
+void harden_raise_priority(void) {
+    if (setpriority(PRIO_PROCESS, 0, -10) != 0)
+        fprintf(stderr, "[i3lock] could not raise the priority: %s\n", strerror(errno));
+    else
+        DEBUG("raised the priority to nice -10\n");
+}
@@ -0,0 +1,12 @@
+#ifndef _HARDEN_H
+#define _HARDEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void harden_init(void);
+void harden_prefault_stack(void);
+bool harden_lock_memory(size_t budget);
+void harden_raise_priority(void);
+
+#endif
@@ -10,17 +10,23 @@
 #include <stdlib.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
+#include <xcb/xinerama.h>
 #include <err.h>
 #include <assert.h>
-#include <security/pam_appl.h>
 #include <getopt.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include <ev.h>
 #include <sys/mman.h>
 #include <xkbcommon/xkbcommon.h>
@@ -30,6 +36,19 @@
 #include <cairo/cairo-xcb.h>
 
 #include "i3lock.h"
+#include "animation.h"
+#include "auth.h"
+#include "harden.h"
+#include "images.h"
+#include "ipc.h"
+#include "supervisor.h"
+#include "keymap_cache.h"
+#include "keys.h"
+#include "notify.h"
+#include "render.h"
+#include "text.h"
+#include "theme.h"
+#include "timing.h"
 #include "xcb.h"
 #include "cursors.h"
 #include "unlock_indicator.h"
@@ -43,54 +62,138 @@
     timer_obj = start_timer(timer_obj, timeout, callback)
 #define STOP_TIMER(timer_obj) \
     timer_obj = stop_timer(timer_obj)
+/* Stops the timer, but keeps it for the next START_TIMER. Used for the timers
+ * which key presses restart, see allocate_input_timers(). */
+#define PAUSE_TIMER(timer_obj)                    \
+    do {                                          \
+        if (timer_obj)                            \
+            ev_timer_stop(main_loop, timer_obj);  \
+    } while (0)
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 
-char color[7] = "000000";
 uint32_t last_resolution[2];
 xcb_window_t win;
 static xcb_cursor_t cursor;
-static pam_handle_t *pam_handle;
 int input_position = 0;
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
 static bool beep = false;
 bool debug_mode = false;
 bool unlock_indicator = true;
-char *modifier_string = NULL;
+const char *modifier_string = NULL;
 static bool dont_fork = false;
+/* The write end of the pipe on which the parent process waits until the
+ * screen is locked, see fork_early(). -1 if there is no parent waiting. */
+static int ready_fd = -1;
+/* Set once the screen is locked for the first time, when the startup phases
+ * are reported. */
+static bool startup_done = false;
+/* The screen is locked once both are set, see lock_ready(). */
+static bool window_mapped = false;
+static bool input_grabbed = false;
+/* The fd given with --ready-fd, see notify.c. */
+static int notify_fd = -1;
+/* With --daemon, i3lock prepares everything but only locks the screen (maps
+ * the window and grabs the input) on SIGUSR1 or a “lock” command on the
+ * socket, and goes back to standby after unlocking. */
+static bool daemon_mode = false;
+static char *socket_path = NULL;
+/* Whether the window is mapped and the input grabbed. */
+static bool locked = false;
+/* What the socket reports (see handle_ipc_command()): “locked” once the
+ * input is grabbed, and since when. */
+static const char *lock_state = "unlocked";
+static ev_tstamp lock_state_since;
 struct ev_loop *main_loop;
 static struct ev_timer *clear_pam_wrong_timeout;
 static struct ev_timer *clear_indicator_timeout;
 static struct ev_timer *discard_passwd_timeout;
+/* Redraws the unlock indicator once a key press is no longer highlighted. */
+static struct ev_timer *key_active_timeout;
+static struct ev_io *auth_watcher;
+static struct ev_timer *auth_timeout_timer;
+static struct ev_timer *keymap_reload_timeout;
+static struct ev_idle *compose_idle;
+/* Seconds after which an authentication attempt is abandoned, 0 = never. */
+static double auth_timeout = 0;
 extern unlock_state_t unlock_state;
 extern pam_state_t pam_state;
 int failed_attempts = 0;
 bool show_failed_attempts = false;
+/* Whether to show the time and date, see update_clock(). */
+static bool show_clock = false;
+static char *time_format = "%H:%M";
+static char *date_format = "%A, %d %B";
+static struct ev_periodic *clock_periodic;
+/* Whether to show the keyboard layout and Caps Lock. */
+static bool show_keyboard_layout = false;
+/* With --hardened, the memory is locked after the first lock (up to this
+ * many bytes, 0 = not hardened), see harden_after_lock(). */
+static size_t hardened_budget = 0;
+static bool memory_lock_attempted = false;
+static bool raise_priority = false;
+/* With --displays, the displays to lock, see supervisor.c. */
+static char **displays;
+static int num_displays;
+/* Whether the image was decoded by the supervisor before forking. */
+static bool images_preloaded = false;
 
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
+/* The active modifiers (see keys.h), updated whenever the XKB state changes. */
+static unsigned int modifiers;
+/* The locale whose compose table still needs to be loaded, see
+ * ensure_compose_table(). */
+static const char *compose_locale;
+/* The core keyboard, looked up once instead of on every XKB event. */
+static int32_t xkb_device_id;
 static uint8_t xkb_base_event;
+/* First event of the MIT-SCREEN-SAVER extension, 0 if it is not available. */
+static uint8_t screensaver_base_event;
+/* Whether the display is blanked. Nothing is drawn in the meantime. */
+bool display_blanked = false;
+/* Number of times the event loop woke up (only counted with --debug), and
+ * the count and time at which the display was blanked. */
+static unsigned long wakeups;
+static unsigned long wakeups_at_blank;
+static double blanked_since;
 static uint8_t xkb_base_error;
 
 cairo_surface_t *img = NULL;
+/* The factor by which img was downscaled to fit into max_image_memory. */
+double img_scale = 1.0;
+/* Upper limit (in bytes) for the decoded image, 0 = unlimited. */
+static size_t max_image_memory = 0;
+/* Upper limit (in bytes) for the images prepared ahead of time, see
+ * images.c. */
+static size_t prefetch_memory = 64 * 1024 * 1024;
+/* Seconds after which the next image is shown while locked, 0 = never. */
+static double rotate_interval = 0;
+static struct ev_timer *rotate_timer;
+/* Presents the frames of an animated image (see animation.c), NULL if the
+ * image is not animated. animation_due is when the current frame ends.
+ * animation_waiting is set while the next frame is not decoded yet, see
+ * animation_ready_cb(). */
+static struct ev_timer *animation_timer;
+static ev_tstamp animation_due;
+static bool animation_waiting;
 bool tile = false;
+/* Whether to keep the traffic to the X server low (see redraw_indicator()). */
+bool low_bandwidth = false;
+/* Whether to show the lock window through the composite overlay window, see
+ * composite_overlay_acquire(). */
+static bool composite_overlay = false;
+static xcb_window_t overlay_win = XCB_NONE;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
 bool use_wallpaper = false;
 double desaturate = 0.0;
 
-char color_icon[7]   = "ffffff";
-char color_wrong[7]  = "ff0000";
-char color_verify[7] = "0000ff";
-char color_bg[7]     = "000000";
-char color_border[7] = "ffffff";
-
-double icon_scale = 4.0;
 
 /* isutf, u8_dec © 2005 Jeff Bezanson, public domain */
 #define isutf(c) (((c)&0xC0) != 0x80)
@@ -103,6 +206,97 @@ void u8_dec(char *s, int *i) {
     (void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
+/*
+ * Shows the current keyboard layout and whether Caps Lock is on, if enabled
+ * with --show-keyboard-layout.
+ *
+ */
+static void update_keyboard_text(void) {
+    if (!show_keyboard_layout || xkb_state == NULL)
+        return;
+
+    char buffer[128];
+    const char *layout = xkb_keymap_layout_get_name(
+        xkb_keymap, xkb_state_serialize_layout(xkb_state, XKB_STATE_LAYOUT_EFFECTIVE));
+    bool caps = (modifiers & KEY_MOD_CAPS);
+
+    snprintf(buffer, sizeof(buffer), "%s%s%s",
+             (layout != NULL ? layout : ""),
+             (layout != NULL && caps ? ", " : ""),
+             (caps ? "Caps Lock" : ""));
+    set_text(TEXT_KEYBOARD, buffer);
+    redraw_text();
+}
+
+/*
+ * Updates the time and date shown with --clock.
+ *
+ */
+static void update_clock(void) {
+    char buffer[128];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+
+    if (strftime(buffer, sizeof(buffer), time_format, &tm) == 0)
+        buffer[0] = '\0';
+    set_text(TEXT_TIME, buffer);
+
+    if (strftime(buffer, sizeof(buffer), date_format, &tm) == 0)
+        buffer[0] = '\0';
+    set_text(TEXT_DATE, buffer);
+}
+
+/*
+ * Called at the start of every minute (as long as the display is on), which
+ * is the smallest unit shown by the default format.
+ *
+ */
+static void clock_cb(EV_P_ ev_periodic *w, int revents) {
+    update_clock();
+    redraw_text();
+}
+
+/*
+ * Shows the number of failed attempts, if enabled with -f.
+ *
+ */
+static void update_failed_text(void) {
+    char buffer[64];
+
+    if (!show_failed_attempts)
+        return;
+
+    if (failed_attempts == 0)
+        buffer[0] = '\0';
+    else
+        snprintf(buffer, sizeof(buffer), "%d failed attempt%s",
+                 failed_attempts, (failed_attempts == 1 ? "" : "s"));
+    set_text(TEXT_FAILED, buffer);
+}
+
+/*
+ * Replaces our keyboard state with the server’s current state (for the
+ * current keymap), e.g. to pick up the modifiers which were active when we
+ * grabbed the keyboard.
+ *
+ */
+static bool sync_keyboard_state(void) {
+    struct xkb_state *new_state =
+        xkb_x11_state_new_from_device(xkb_keymap, conn, xkb_device_id);
+    if (new_state == NULL) {
+        fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        return false;
+    }
+
+    xkb_state_unref(xkb_state);
+    xkb_state = new_state;
+    modifiers = keys_modifiers(xkb_state);
+
+    update_keyboard_text();
+    return true;
+}
+
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
@@ -117,28 +311,21 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
-
-    int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
-    DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
+    DEBUG("device = %d\n", xkb_device_id);
+    struct xkb_keymap *new_keymap = keymap_cache_get(xkb_context, conn, xkb_device_id);
+    if (new_keymap == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
         return false;
     }
 
-    struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
-    if (new_state == NULL) {
-        fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
-        return false;
-    }
-
-    xkb_state_unref(xkb_state);
-    xkb_state = new_state;
+    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap = new_keymap;
+    keys_set_keymap(xkb_keymap);
 
-    return true;
+    return sync_keyboard_state();
 }
 
+
 /*
  * Loads the XKB compose table from the given locale.
  *
@@ -163,6 +350,75 @@ static bool load_compose_table(const char *locale) {
     return true;
 }
 
+/*
+ * Returns the locale whose compose table is used.
+ *
+ */
+static const char *detect_locale(void) {
+    const char *locale = getenv("LC_ALL");
+    if (!locale)
+        locale = getenv("LC_CTYPE");
+    if (!locale)
+        locale = getenv("LANG");
+    if (!locale) {
+        if (debug_mode)
+            fprintf(stderr, "Can't detect your locale, fallback to C\n");
+        locale = "C";
+    }
+    return locale;
+}
+
+/*
+ * Parsing the compose table takes a while (Compose files have thousands of
+ * lines) and it is only needed for dead keys and the Multi_key, so we don’t
+ * load it before locking the screen. Instead, it is loaded once the event
+ * loop is idle after the window was mapped, or right before it is needed,
+ * whichever happens first.
+ *
+ */
+static void ensure_compose_table(void) {
+    if (compose_locale == NULL)
+        return;
+
+    const char *locale = compose_locale;
+    /* Only try once, even if loading fails. */
+    compose_locale = NULL;
+    if (compose_idle != NULL)
+        ev_idle_stop(main_loop, compose_idle);
+
+    DEBUG("loading compose table for locale %s\n", locale);
+    (void)load_compose_table(locale);
+}
+
+static void compose_idle_cb(EV_P_ ev_idle *w, int revents) {
+    ensure_compose_table();
+}
+
+/*
+ * Looks up every key in the keymap and feeds the compose state machine, so
+ * that the tables are resident before the next key press.
+ *
+ */
+static void touch_keyboard_tables(void) {
+    if (xkb_state != NULL) {
+        for (xkb_keycode_t keycode = 8; keycode < 256; keycode++)
+            (void)xkb_state_key_get_one_sym(xkb_state, keycode);
+    }
+
+    if (xkb_compose_table != NULL) {
+        /* A separate state, which is thrown away afterwards. */
+        struct xkb_compose_state *state = xkb_compose_state_new(xkb_compose_table, 0);
+        if (state != NULL) {
+            for (xkb_keysym_t sym = XKB_KEY_dead_grave; sym <= XKB_KEY_dead_longsolidusoverlay; sym++) {
+                xkb_compose_state_feed(state, sym);
+                xkb_compose_state_reset(state);
+            }
+            xkb_compose_state_feed(state, XKB_KEY_Multi_key);
+            xkb_compose_state_unref(state);
+        }
+    }
+}
+
 /*
  * Clears the memory which stored the password to be a bit safer against
  * cold-boot attacks.
@@ -206,28 +462,37 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
 }
 
 /*
- * Resets pam_state to STATE_PAM_IDLE 2 seconds after an unsuccessful
- * authentication event.
+ * Resets pam_state to STATE_PAM_IDLE, which happens 2 seconds after an
+ * unsuccessful authentication event (or earlier, see display_off()).
  *
  */
-static void clear_pam_wrong(EV_P_ ev_timer *w, int revents) {
+static void reset_pam_wrong(void) {
     DEBUG("clearing pam wrong\n");
     pam_state = STATE_PAM_IDLE;
     redraw_screen();
 
     /* Clear modifier string. */
-    if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
+    modifier_string = NULL;
 
-    /* Now free this timeout. */
-    STOP_TIMER(clear_pam_wrong_timeout);
+    PAUSE_TIMER(clear_pam_wrong_timeout);
 }
 
-static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
+static void clear_pam_wrong(EV_P_ ev_timer *w, int revents) {
+    reset_pam_wrong();
+}
+
+/*
+ * Hides the unlock indicator a second after the password became empty (or
+ * earlier, see display_off()).
+ *
+ */
+static void expire_indicator(void) {
     clear_indicator();
-    STOP_TIMER(clear_indicator_timeout);
+    PAUSE_TIMER(clear_indicator_timeout);
+}
+
+static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
+    expire_indicator();
 }
 
 static void clear_input(void) {
@@ -238,29 +503,106 @@ static void clear_input(void) {
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     clear_input();
-    STOP_TIMER(discard_passwd_timeout);
+    PAUSE_TIMER(discard_passwd_timeout);
 }
 
+/*
+ * Records the new state (“locked” or “unlocked”) for state queries and tells
+ * the subscribers of the socket.
+ *
+ */
+static void set_lock_state(const char *state) {
+    lock_state = state;
+    lock_state_since = ev_time();
+    ipc_publish(state);
+}
+
+static void auth_failed(void);
+static void auth_timeout_cb(EV_P_ ev_timer *w, int revents);
+static void unlock_to_standby(void);
+static void report_ready(void);
+static void lock_ready(void);
+static void start_animation(void);
+static void stop_animation(void);
+
 static void input_done(void) {
-    STOP_TIMER(clear_pam_wrong_timeout);
+    PAUSE_TIMER(clear_pam_wrong_timeout);
     pam_state = STATE_PAM_VERIFY;
     unlock_state = STATE_STARTED;
     redraw_screen();
 
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+    /* The helper has its own copy now, so we can already clear ours. Keys
+     * pressed while PAM is busy go into the next attempt. */
+    bool sent = auth_helper_send(password, input_position);
+    clear_input();
+
+    if (!sent) {
+        fprintf(stderr, "[i3lock] could not hand the password to the authentication helper\n");
+        auth_failed();
+        return;
+    }
+
+    ev_io_set(auth_watcher, auth_helper_fd(), EV_READ);
+    ev_io_start(main_loop, auth_watcher);
+    ipc_publish("auth-started");
+
+    if (auth_timeout > 0) {
+        ev_now_update(main_loop);
+        START_TIMER(auth_timeout_timer, auth_timeout, auth_timeout_cb);
+    }
+}
+
+/*
+ * Called when the authentication helper has a result for us (or died).
+ *
+ */
+static void auth_result_cb(EV_P_ ev_io *w, int revents) {
+    auth_result_t result;
+
+    if (!auth_helper_read_result(&result))
+        return;
 
-        /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
-         * Related to credentials pam_end() needs to be called to cleanup any temporary
-         * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
-         * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
-        pam_end(pam_handle, PAM_SUCCESS);
+    ev_io_stop(main_loop, auth_watcher);
+    STOP_TIMER(auth_timeout_timer);
 
+    if (result == AUTH_RESULT_SUCCESS) {
+        DEBUG("successfully authenticated\n");
+        if (debug_mode)
+            auth_latency_dump(stdout);
+        set_lock_state("unlocked");
+        if (daemon_mode) {
+            unlock_to_standby();
+            return;
+        }
         exit(0);
     }
 
+    auth_failed();
+}
+
+/*
+ * Called when PAM did not answer within --auth-timeout seconds (e.g. because
+ * a network PAM module hangs). The attempt is abandoned so that the user can
+ * try again as soon as the authentication backend recovers.
+ *
+ */
+static void auth_timeout_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(auth_timeout_timer);
+    ev_io_stop(main_loop, auth_watcher);
+    auth_helper_cancel();
+
+    ipc_publish("auth-failed");
+    pam_state = STATE_PAM_TIMEOUT;
+    if (unlock_indicator)
+        redraw_screen();
+
+    /* Show the timeout state for a bit, but unlike STATE_PAM_WRONG, it does
+     * not prevent the user from trying again right away. */
+    START_TIMER(clear_pam_wrong_timeout, TSTAMP_N_SECS(2), clear_pam_wrong);
+    PAUSE_TIMER(clear_indicator_timeout);
+}
+
+static void auth_failed(void) {
     if (debug_mode)
         fprintf(stderr, "Authentication failure\n");
 
@@ -299,9 +641,10 @@ static void input_done(void) {
     /*     } */
     /* } */
 
+    ipc_publish("auth-failed");
     pam_state = STATE_PAM_WRONG;
     failed_attempts += 1;
-    clear_input();
+    update_failed_text();
     if (unlock_indicator)
         redraw_screen();
 
@@ -312,7 +655,7 @@ static void input_done(void) {
 
     /* Cancel the clear_indicator_timeout, it would hide the unlock indicator
      * too early. */
-    STOP_TIMER(clear_indicator_timeout);
+    PAUSE_TIMER(clear_indicator_timeout);
 
     /* beep on authentication failure, if enabled */
     if (beep) {
@@ -323,7 +666,29 @@ static void input_done(void) {
 
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
     redraw_screen();
-    STOP_TIMER(w);
+}
+
+/*
+ * Allocates the timers which key presses start, so that handling a key press
+ * does not need to allocate memory (see handle_key_press()). They are only
+ * paused afterwards, never freed. If there is no memory, START_TIMER tries
+ * again later.
+ *
+ */
+static void allocate_input_timers(void) {
+    struct {
+        ev_timer **timer_obj;
+        ev_callback_t callback;
+    } timers[] = {
+        {&clear_pam_wrong_timeout, clear_pam_wrong},
+        {&clear_indicator_timeout, clear_indicator_cb},
+        {&discard_passwd_timeout, discard_passwd_cb},
+        {&key_active_timeout, redraw_timeout},
+    };
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++) {
+        if ((*timers[i].timer_obj = calloc(sizeof(struct ev_timer), 1)) != NULL)
+            ev_timer_init(*timers[i].timer_obj, timers[i].callback, 0., 0.);
+    }
 }
 
 static bool skip_without_validation(void) {
@@ -337,38 +702,27 @@ static bool skip_without_validation(void) {
 }
 
 /*
- * Handle key presses. Fixes state, then looks up the key symbol for the
- * given keycode, then looks up the key symbol (as UCS-2), converts it to
- * UTF-8 and stores it in the password array.
+ * Handle key presses. Looks up the key symbol for the given keycode, feeds it
+ * to the compose state, and then does what the key stands for (see
+ * keys_classify()): the text of ordinary keys (converted to UTF-8) is stored
+ * in the password array. Nothing in here allocates memory, the timers are
+ * allocated once, see allocate_input_timers().
  *
  */
 static void handle_key_press(xcb_key_press_event_t *event) {
     xkb_keysym_t ksym;
+    /* Not cleared, xkb_keysym_to_utf8() and xkb_compose_state_get_utf8()
+     * terminate the string. */
     char buffer[128];
     int n;
-    bool ctrl;
-    bool caps;
     bool composed = false;
 
     ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
-    ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
-    caps = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CAPS, XKB_STATE_MODS_EFFECTIVE);
-
-    /* Set modifier string to caps if on */
-    if (caps) {
-        if (modifier_string == NULL) {
-            char* tmp;
-            if (asprintf(&tmp, "Caps Lock") != -1) {
-                modifier_string = tmp;
-            }
-        }
-    } else if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
+    if (keys_starts_compose(ksym))
+        ensure_compose_table();
 
-    /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
-    memset(buffer, '\0', sizeof(buffer));
+    /* Show the dots in a different color while Caps Lock is on. */
+    modifier_string = ((modifiers & KEY_MOD_CAPS) ? "Caps Lock" : NULL);
 
     if (xkb_compose_state && xkb_compose_state_feed(xkb_compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED) {
         switch (xkb_compose_state_get_status(xkb_compose_state)) {
@@ -393,15 +747,13 @@ static void handle_key_press(xcb_key_press_event_t *event) {
         n = xkb_keysym_to_utf8(ksym, buffer, sizeof(buffer));
     }
 
-    switch (ksym) {
-        case XKB_KEY_j:
-        case XKB_KEY_Return:
-        case XKB_KEY_KP_Enter:
-        case XKB_KEY_XF86ScreenSaver:
-            if (ksym == XKB_KEY_j && !ctrl)
-                break;
+    const key_action_t action = keys_classify(ksym, modifiers);
+    if (action != KEY_ACTION_SUBMIT)
+        skip_repeated_empty_password = false;
 
-            if (pam_state == STATE_PAM_WRONG)
+    switch (action) {
+        case KEY_ACTION_SUBMIT:
+            if (pam_state == STATE_PAM_VERIFY || pam_state == STATE_PAM_WRONG)
                 return;
 
             if (skip_without_validation()) {
@@ -414,42 +766,24 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             input_done();
             skip_repeated_empty_password = true;
             return;
-        default:
-            skip_repeated_empty_password = false;
-    }
 
-    switch (ksym) {
-        case XKB_KEY_u:
-        case XKB_KEY_Escape:
-            if ((ksym == XKB_KEY_u && ctrl) ||
-                ksym == XKB_KEY_Escape) {
-                DEBUG("C-u pressed\n");
-                clear_input();
-                /* Hide the unlock indicator after a bit if the password buffer is
-                 * empty. */
-                if (unlock_indicator) {
-                    START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
-                    unlock_state = STATE_BACKSPACE_ACTIVE;
-                    redraw_screen();
-                    unlock_state = STATE_KEY_PRESSED;
-                }
-                return;
+        case KEY_ACTION_CLEAR:
+            DEBUG("C-u pressed\n");
+            clear_input();
+            /* Hide the unlock indicator after a bit if the password buffer is
+             * empty. */
+            if (unlock_indicator) {
+                START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
+                unlock_state = STATE_BACKSPACE_ACTIVE;
+                redraw_screen();
+                unlock_state = STATE_KEY_PRESSED;
             }
-            break;
-
-        case XKB_KEY_Delete:
-        case XKB_KEY_KP_Delete:
-            /* Deleting forward doesn’t make sense, as i3lock doesn’t allow you
-             * to move the cursor when entering a password. We need to eat this
-             * key press so that it won’t be treated as part of the password,
-             * see issue #50. */
             return;
 
-        case XKB_KEY_h:
-        case XKB_KEY_BackSpace:
-            if (ksym == XKB_KEY_h && !ctrl)
-                break;
+        case KEY_ACTION_IGNORE:
+            return;
 
+        case KEY_ACTION_ERASE:
             if (input_position == 0)
                 return;
 
@@ -464,6 +798,9 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             redraw_screen();
             unlock_state = STATE_KEY_PRESSED;
             return;
+
+        case KEY_ACTION_INPUT:
+            break;
     }
 
     if ((input_position + 8) >= sizeof(password))
@@ -493,9 +830,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
         redraw_screen();
         unlock_state = STATE_KEY_PRESSED;
 
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
-        STOP_TIMER(clear_indicator_timeout);
+        START_TIMER(key_active_timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
+        PAUSE_TIMER(clear_indicator_timeout);
     }
 
     START_TIMER(discard_passwd_timeout, TSTAMP_N_MINS(3), discard_passwd_cb);
@@ -507,11 +843,12 @@ static void handle_key_press(xcb_key_press_event_t *event) {
  * some area of the i3lock window.
  *
  * In this case, we raise our window on top so that the popup (or whatever is
- * hiding us) gets hidden.
+ * hiding us) gets hidden. Since PAM runs in the authentication helper, the
+ * event loop never blocks, so this is done right here instead of in a
+ * separate process with its own X11 connection.
  *
  */
-static void handle_visibility_notify(xcb_connection_t *conn,
-                                     xcb_visibility_notify_event_t *event) {
+static void handle_visibility_notify(xcb_visibility_notify_event_t *event) {
     if (event->state != XCB_VISIBILITY_UNOBSCURED) {
         uint32_t values[] = {XCB_STACK_MODE_ABOVE};
         xcb_configure_window(conn, event->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
@@ -519,6 +856,84 @@ static void handle_visibility_notify(xcb_connection_t *conn,
     }
 }
 
+/*
+ * The display was blanked: pending visual changes (e.g. hiding the unlock
+ * indicator after a second) are applied right away instead of waking up for
+ * them, and the event mask is narrowed so that only input wakes us up.
+ *
+ */
+static void display_off(void) {
+    if (display_blanked)
+        return;
+
+    DEBUG("display blanked\n");
+    display_blanked = true;
+    wakeups_at_blank = wakeups;
+    blanked_since = now_ms();
+
+    /* Both redraw, which does nothing while blanked. */
+    if (clear_indicator_timeout && ev_is_active(clear_indicator_timeout))
+        expire_indicator();
+    if (clear_pam_wrong_timeout && ev_is_active(clear_pam_wrong_timeout))
+        reset_pam_wrong();
+    if (clock_periodic)
+        ev_periodic_stop(main_loop, clock_periodic);
+    if (rotate_timer)
+        ev_timer_stop(main_loop, rotate_timer);
+    stop_animation();
+
+    set_lock_window_blanked(conn, win, true);
+}
+
+/*
+ * The display is back: restore the event mask and draw the current state
+ * once. We did not track visibility changes in the meantime, so the window is
+ * also raised in case anything was mapped on top of it.
+ *
+ */
+static void display_on(void) {
+    if (!display_blanked)
+        return;
+
+    display_blanked = false;
+    DEBUG("display unblanked, %lu wakeups in %.1f s while blanked\n",
+          wakeups - wakeups_at_blank, (now_ms() - blanked_since) / 1000.0);
+
+    set_lock_window_blanked(conn, win, false);
+    if (locked) {
+        uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+        xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
+    }
+    if (clock_periodic && locked) {
+        update_clock();
+        ev_periodic_start(main_loop, clock_periodic);
+    }
+    if (rotate_timer && locked)
+        ev_timer_start(main_loop, rotate_timer);
+    /* E.g. after a suspend, read the tables back before the first key
+     * press needs them, in case they were not locked. */
+    if (hardened_budget > 0)
+        touch_keyboard_tables();
+    redraw_screen();
+    start_animation();
+}
+
+static void handle_screensaver_notify(xcb_screensaver_notify_event_t *event) {
+    if (event->state == XCB_SCREENSAVER_STATE_ON)
+        display_off();
+    else if (event->state == XCB_SCREENSAVER_STATE_OFF)
+        display_on();
+}
+
+/*
+ * Reloads the keymap once a burst of keymap change notifications is over.
+ *
+ */
+static void keymap_reload_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(keymap_reload_timeout);
+    (void)load_keymap();
+}
+
 /*
  * Called when the keyboard mapping changes. We update our symbols.
  *
@@ -542,22 +957,27 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
 
     DEBUG("process_xkb_event for device %d\n", event->any.deviceID);
 
-    if (event->any.deviceID != xkb_x11_get_core_keyboard_device_id(conn))
+    /* The core keyboard can only change along with a NewKeyboardNotify. */
+    if (event->any.xkbType == XCB_XKB_NEW_KEYBOARD_NOTIFY)
+        xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn);
+
+    if (event->any.deviceID != xkb_device_id)
         return;
 
     /*
      * XkbNewKkdNotify and XkbMapNotify together capture all sorts of keymap
      * updates (e.g. xmodmap, xkbcomp, setxkbmap), with minimal redundent
-     * recompilations.
+     * recompilations. Tools like setxkbmap send several of them in a row, so
+     * we wait until they stop coming (for 50 ms) before reloading the keymap.
      */
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                START_TIMER(keymap_reload_timeout, TSTAMP_N_SECS(0.05), keymap_reload_cb);
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            START_TIMER(keymap_reload_timeout, TSTAMP_N_SECS(0.05), keymap_reload_cb);
             break;
 
         case XCB_XKB_STATE_NOTIFY:
@@ -568,6 +988,8 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
                                   event->state_notify.baseGroup,
                                   event->state_notify.latchedGroup,
                                   event->state_notify.lockedGroup);
+            modifiers = keys_modifiers(xkb_state);
+            update_keyboard_text();
             break;
     }
 }
@@ -596,45 +1018,313 @@ void handle_screen_resize(void) {
 
     free(geom);
 
-    redraw_screen();
-
+    /* The render thread clears the window with its new size on its own
+     * connection, so the resize has to be processed first. */
     uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
     xcb_configure_window(conn, win, mask, last_resolution);
-    xcb_flush(conn);
+    sync_with_server(conn);
 
     xinerama_query_screens();
     redraw_screen();
 }
 
 /*
- * Callback function for PAM. We only react on password request callbacks.
+ * With --hardened: makes sure everything needed to handle the next key press
+ * is resident, and after the first lock locks it in memory.
  *
  */
-static int conv_callback(int num_msg, const struct pam_message **msg,
-                         struct pam_response **resp, void *appdata_ptr) {
-    if (num_msg == 0)
-        return 1;
-
-    /* PAM expects an array of responses, one for each message */
-    if ((*resp = calloc(num_msg, sizeof(struct pam_response))) == NULL) {
-        perror("calloc");
-        return 1;
+static void harden_after_lock(void) {
+    if (hardened_budget == 0)
+        return;
+
+    ensure_compose_table();
+    touch_keyboard_tables();
+
+    if (!memory_lock_attempted) {
+        memory_lock_attempted = true;
+        /* Called from the event loop, i.e. at about the depth where key
+         * presses are handled. */
+        harden_prefault_stack();
+        (void)harden_lock_memory(hardened_budget);
     }
+}
 
-    for (int c = 0; c < num_msg; c++) {
-        if (msg[c]->msg_style != PAM_PROMPT_ECHO_OFF &&
-            msg[c]->msg_style != PAM_PROMPT_ECHO_ON)
-            continue;
+/*
+ * Called once pointer and keyboard are grabbed (see lock_screen()), which
+ * completes locking the screen.
+ *
+ */
+static void grab_done(bool success) {
+    phase_end(PHASE_GRAB);
+
+    if (!success) {
+        if (!daemon_mode)
+            errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+        /* Nothing is locked, but the next lock request may work. */
+        ipc_reply_waiting("error: grab failed");
+        unlock_to_standby();
+        return;
+    }
 
-        /* return code is currently not used but should be set to zero */
-        resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
-            perror("strdup");
-            return 1;
-        }
+    /* Sync the current modifier state. Since we first loaded the keymap, there
+     * might have been changes, but starting from now, we should get all key
+     * presses/releases due to having grabbed the keyboard. Keymap changes
+     * result in a MapNotify, so the keymap itself does not need to be
+     * reloaded. */
+    (void)sync_keyboard_state();
+
+    input_grabbed = true;
+    if (window_mapped)
+        lock_ready();
+}
+
+/*
+ * Called once the window is mapped and pointer and keyboard are grabbed,
+ * whichever happens last. The window has the frame as its background, which
+ * the server paints as part of mapping it, so the screen is locked now.
+ *
+ */
+static void lock_ready(void) {
+    report_ready();
+    notify_locked();
+    set_lock_state("locked");
+    ipc_reply_waiting("ok");
+    harden_after_lock();
+
+    if (!startup_done) {
+        startup_done = true;
+        phase_report();
+    }
+}
+
+/*
+ * Called whenever the prefetch thread prepared an image (see images.c). Up to
+ * one image is uploaded to the X server ahead of time, so that switching to it
+ * is only a matter of using another pixmap.
+ *
+ */
+static void next_image_cb(void) {
+    if (next_background_ready())
+        return;
+
+    double scale;
+    cairo_surface_t *next = images_take(&scale);
+    if (next == NULL)
+        return;
+    prepare_next_background(next, scale);
+    cairo_surface_destroy(next);
+}
+
+/*
+ * Switches to the next background if it is ready (it never waits for an
+ * image to be decoded) and prepares the one after it.
+ *
+ */
+static void next_background(void) {
+    if (!switch_background()) {
+        DEBUG("the next background is not ready yet, keeping the current one\n");
+        return;
+    }
+    redraw_screen();
+    next_image_cb();
+}
+
+static void rotate_cb(EV_P_ ev_timer *w, int revents) {
+    next_background();
+}
+
+/*
+ * Shows the next frame of the animation. The frames are decoded ahead of
+ * time, so this only uploads one. If the next frame is not ready yet, the
+ * current one stays until it is, see animation_ready_cb().
+ *
+ */
+static void animation_cb(EV_P_ ev_timer *w, int revents) {
+    double scale, delay;
+    cairo_surface_t *frame = animation_next_frame(&scale, &delay);
+    if (frame == NULL) {
+        animation_waiting = !animation_done();
+        return;
+    }
+    update_background(frame, scale);
+    redraw_screen();
+
+    /* Schedule relative to when this frame was due, not to when we got
+     * around to showing it, so that the delays do not add up. Unless we are
+     * more than a frame late, then there is no point in catching up. */
+    animation_due += delay;
+    if (animation_due < ev_now(main_loop))
+        animation_due = ev_now(main_loop);
+    ev_timer_set(w, animation_due - ev_now(main_loop), 0.);
+    ev_timer_start(main_loop, w);
+}
+
+/*
+ * Called by the decoding thread (through an ev_async) when a frame was
+ * decoded. If the animation was waiting for it, it is shown right away.
+ *
+ */
+static void animation_ready_cb(void) {
+    if (!animation_waiting)
+        return;
+    animation_waiting = false;
+    animation_due = ev_now(main_loop);
+    animation_cb(main_loop, animation_timer, 0);
+}
+
+/*
+ * Starts (or resumes) the animation, if any, with the next frame.
+ *
+ */
+static void start_animation(void) {
+    if (animation_timer == NULL || display_blanked || !locked)
+        return;
+    animation_waiting = false;
+    animation_due = ev_now(main_loop);
+    ev_timer_set(animation_timer, 0., 0.);
+    ev_timer_start(main_loop, animation_timer);
+}
+
+static void stop_animation(void) {
+    if (animation_timer)
+        ev_timer_stop(main_loop, animation_timer);
+    animation_waiting = false;
+}
+
+/*
+ * Locks the screen: maps the (already prepared) window and grabs pointer and
+ * keyboard. Called once at startup, or in --daemon mode whenever a lock is
+ * requested.
+ *
+ */
+static void lock_screen(void) {
+    if (locked)
+        return;
+
+    DEBUG("locking the screen\n");
+    if (clock_periodic) {
+        update_clock();
+        redraw_text();
+        if (!display_blanked)
+            ev_periodic_start(main_loop, clock_periodic);
+    }
+    if (rotate_timer && !display_blanked)
+        ev_timer_start(main_loop, rotate_timer);
+
+    if (composite_overlay) {
+        double start = now_ms();
+        overlay_win = composite_overlay_acquire(conn, screen, win);
+        if (overlay_win != XCB_NONE)
+            DEBUG("showing the lock window in the overlay window 0x%08x (%.2f ms)\n",
+                  overlay_win, now_ms() - start);
     }
 
-    return 0;
+    /* The window is mapped (and painted) right away, while the grabs are
+     * acquired from the event loop. */
+    map_lock_window(conn, win);
+
+    phase_begin(PHASE_GRAB);
+    grab_pointer_and_keyboard(conn, screen, cursor, grab_done);
+
+    locked = true;
+    start_animation();
+}
+
+/*
+ * Goes back to standby after a successful authentication in --daemon mode:
+ * the window is unmapped and the grabs are released, but everything else is
+ * kept, so that the next lock only needs to map the window and grab again.
+ *
+ */
+static void unlock_to_standby(void) {
+    DEBUG("unlocked, going back to standby\n");
+    grab_cancel();
+    unmap_lock_window(conn, win);
+    if (overlay_win != XCB_NONE) {
+        composite_overlay_release(conn, screen, win);
+        overlay_win = XCB_NONE;
+    }
+    if (clock_periodic)
+        ev_periodic_stop(main_loop, clock_periodic);
+    if (rotate_timer)
+        ev_timer_stop(main_loop, rotate_timer);
+    stop_animation();
+    locked = false;
+    window_mapped = false;
+    input_grabbed = false;
+
+    PAUSE_TIMER(clear_pam_wrong_timeout);
+    PAUSE_TIMER(clear_indicator_timeout);
+    PAUSE_TIMER(discard_passwd_timeout);
+    PAUSE_TIMER(key_active_timeout);
+    clear_input();
+    modifier_string = NULL;
+    failed_attempts = 0;
+    update_failed_text();
+    skip_repeated_empty_password = false;
+    pam_state = STATE_PAM_IDLE;
+    unlock_state = STATE_STARTED;
+
+    /* Prepare the frame for the next lock while nobody is waiting for it,
+     * with the next background, if any. */
+    if (switch_background())
+        next_image_cb();
+    redraw_screen();
+}
+
+/*
+ * Reads the theme file again on SIGHUP. Only what changed is rendered again:
+ * e.g. a new indicator color does not re-render the background.
+ *
+ */
+static void reload_theme_cb(EV_P_ ev_signal *w, int revents) {
+    theme_t *new_theme = theme_compile();
+    if (new_theme == NULL) {
+        fprintf(stderr, "[i3lock] keeping the current theme\n");
+        return;
+    }
+
+    /* The render thread switches to the new theme (and renders the
+     * background again if needed) before the next redraw. */
+    unsigned int changes = set_theme(new_theme);
+    DEBUG("reloaded the theme, changes = 0x%x\n", changes);
+
+    if (changes != 0)
+        redraw_screen();
+}
+
+static void lock_signal_cb(EV_P_ ev_signal *w, int revents) {
+    lock_screen();
+}
+
+/*
+ * Handles commands received on the socket (see ipc.c).
+ *
+ */
+static const char *handle_ipc_command(const char *command) {
+    static char reply[128];
+
+    if (strcmp(command, "lock") == 0) {
+        lock_screen();
+        /* Answered once the screen is locked (see lock_ready()), or
+         * locking failed (see grab_done()). */
+        if (strcmp(lock_state, "locked") == 0)
+            return "ok";
+        return IPC_REPLY_LATER;
+    }
+    if (strcmp(command, "state") == 0) {
+        snprintf(reply, sizeof(reply), "%s %.3f", lock_state, lock_state_since);
+        return reply;
+    }
+    if (strcmp(command, "stats") == 0) {
+        frame_stats_t stats = frame_stats();
+        snprintf(reply, sizeof(reply), "%lu %llu %llu %llu", stats.frames,
+                 (unsigned long long)stats.last_bytes,
+                 (unsigned long long)stats.max_bytes,
+                 (unsigned long long)stats.total_bytes);
+        return reply;
+    }
+    return NULL;
 }
 
 /*
@@ -651,23 +1341,78 @@ static void xcb_got_event(EV_P_ struct ev_io *w, int revents) {
  *
  */
 static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    /* Called right before the loop blocks, i.e. once per wakeup. */
+    if (debug_mode)
+        wakeups++;
     xcb_flush(conn);
 }
 
 /*
- * Try closing logind sleep lock fd passed over from xss-lock, in case we're
- * being run from there.
+ * Forks before anything big is allocated (the image in particular), so that
+ * no copy-on-write pages are shared between the two processes. The parent
+ * waits until the child reports that the screen is locked (see
+ * report_ready()) and then exits, so callers can still rely on the screen
+ * being locked once i3lock returns. If the child exits before that, the
+ * parent exits with its status.
  *
  */
-static void maybe_close_sleep_lock_fd(void) {
-    const char *sleep_lock_fd = getenv("XSS_SLEEP_LOCK_FD");
-    char *endptr;
-    if (sleep_lock_fd && *sleep_lock_fd != 0) {
-        long int fd = strtol(sleep_lock_fd, &endptr, 10);
-        if (*endptr == 0) {
-            close(fd);
-        }
+static void fork_early(void) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        err(EXIT_FAILURE, "pipe");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        err(EXIT_FAILURE, "fork");
+
+    if (pid == 0) {
+        /* Child. SIGPIPE is already ignored (see main()), so writing to the
+         * pipe after the parent is gone does not kill us. */
+        close(fds[0]);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        ready_fd = fds[1];
+        return;
     }
+
+    close(fds[1]);
+    /* Only the child notifies, once the screen is locked. */
+    notify_release();
+    char byte;
+    ssize_t n;
+    do {
+        n = read(fds[0], &byte, sizeof(byte));
+    } while (n == -1 && errno == EINTR);
+
+    if (n == sizeof(byte))
+        exit(EXIT_SUCCESS);
+
+    /* The child exited (or crashed) before locking the screen. */
+    int status;
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+        exit(WEXITSTATUS(status));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Tells the waiting parent process (if any) that the window is mapped and
+ * the input is grabbed.
+ *
+ */
+static void report_ready(void) {
+    if (ready_fd == -1)
+        return;
+
+    char byte = 0;
+    ssize_t n;
+    do {
+        n = write(ready_fd, &byte, sizeof(byte));
+    } while (n == -1 && errno == EINTR);
+    /* E.g. the parent was killed by a timeout of its caller. The screen is
+     * locked either way, so we keep running. */
+    if (n != sizeof(byte))
+        DEBUG("could not tell the parent process that the screen is locked: %s\n", strerror(errno));
+    close(ready_fd);
+    ready_fd = -1;
 }
 
 /*
@@ -700,99 +1445,106 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                 break;
 
             case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
+                handle_visibility_notify((xcb_visibility_notify_event_t *)event);
                 break;
 
             case XCB_MAP_NOTIFY:
-                maybe_close_sleep_lock_fd();
-                if (!dont_fork) {
-                    /* After the first MapNotify, we never fork again. We don’t
-                     * expect to get another MapNotify, but better be sure… */
-                    dont_fork = true;
-
-                    /* In the parent process, we exit */
-                    if (fork() != 0)
-                        exit(0);
-
-                    ev_loop_fork(EV_DEFAULT);
+                /* We also watch the compositor’s window, see xcb.c. */
+                if (((xcb_map_notify_event_t *)event)->window != win)
+                    break;
+                if (compose_locale != NULL)
+                    ev_idle_start(main_loop, compose_idle);
+                if (locked && !window_mapped) {
+                    window_mapped = true;
+                    if (!startup_done)
+                        phase_end(PHASE_MAP);
+                    if (input_grabbed)
+                        lock_ready();
                 }
                 break;
 
             case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
+                if (((xcb_configure_notify_event_t *)event)->window == screen->root)
+                    handle_screen_resize();
+                break;
+
+            case XCB_DESTROY_NOTIFY:
+                composite_overlay_handle_destroy(conn, screen, ((xcb_destroy_notify_event_t *)event)->window);
                 break;
 
             default:
                 if (type == xkb_base_event)
                     process_xkb_event(event);
+                else if (screensaver_base_event != 0 &&
+                         type == screensaver_base_event + XCB_SCREENSAVER_NOTIFY)
+                    handle_screensaver_notify((xcb_screensaver_notify_event_t *)event);
         }
 
         free(event);
     }
+
+    /* Replies to grab requests arrive on the same connection. */
+    grab_poll();
 }
 
 /*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to PAM.
+ * With --displays: loads what the sessions can share before they are forked
+ * (see supervisor.c), i.e. everything that depends on the files and the
+ * locale, but not on the display. Keymaps do depend on the display, but are
+ * identical on most, so every distinct keymap is compiled once and found in
+ * the keymap cache by the sessions.
  *
  */
-static void raise_loop(xcb_window_t window) {
-    xcb_connection_t *conn;
-    xcb_generic_event_t *event;
-    int screens;
-
-    if ((conn = xcb_connect(NULL, &screens)) == NULL ||
-        xcb_connection_has_error(conn))
-        errx(EXIT_FAILURE, "Cannot open display\n");
-
-    /* We need to know about the window being obscured or getting destroyed. */
-    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){
-                                     XCB_EVENT_MASK_VISIBILITY_CHANGE |
-                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-    xcb_flush(conn);
-
-    DEBUG("Watching window 0x%08x\n", window);
-    while ((event = xcb_wait_for_event(conn)) != NULL) {
-        if (event->response_type == 0) {
-            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
-            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
-                  error->sequence, error->error_code);
-            free(event);
+static void preload_shared_assets(void) {
+    if (images_count() > 0) {
+        images_start(max_image_memory, desaturate, prefetch_memory, false);
+        img = images_wait(&img_scale);
+        images_preloaded = true;
+    }
+    /* The format of the screens, if they all have the same. */
+    cairo_format_t format = CAIRO_FORMAT_INVALID;
+    bool same_format = true;
+    int connected = 0;
+
+    if ((xkb_context = xkb_context_new(0)) == NULL)
+        errx(EXIT_FAILURE, "could not create xkbcommon context");
+    (void)load_compose_table(detect_locale());
+
+    for (int i = 0; i < num_displays; i++) {
+        xcb_connection_t *display_conn = xcb_connect(displays[i], NULL);
+        if (xcb_connection_has_error(display_conn)) {
+            /* The session reports the error. */
+            xcb_disconnect(display_conn);
             continue;
         }
-        /* Strip off the highest bit (set if the event is generated) */
-        int type = (event->response_type & 0x7F);
-        DEBUG("Read event of type %d\n", type);
-        switch (type) {
-            case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
-                break;
-            case XCB_UNMAP_NOTIFY:
-                DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
-                if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            case XCB_DESTROY_NOTIFY:
-                DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
-                if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            default:
-                DEBUG("Unhandled event type %d\n", type);
-                break;
+        if (xkb_x11_setup_xkb_extension(display_conn,
+                                        XKB_X11_MIN_MAJOR_XKB_VERSION,
+                                        XKB_X11_MIN_MINOR_XKB_VERSION,
+                                        0, NULL, NULL, NULL, NULL) == 1) {
+            int32_t device_id = xkb_x11_get_core_keyboard_device_id(display_conn);
+            if (device_id != -1)
+                xkb_keymap_unref(keymap_cache_get(xkb_context, display_conn, device_id));
         }
-        free(event);
+        cairo_format_t display_format =
+            screen_format(display_conn, xcb_setup_roots_iterator(xcb_get_setup(display_conn)).data);
+        if (connected++ > 0 && display_format != format)
+            same_format = false;
+        format = display_format;
+        xcb_disconnect(display_conn);
+    }
+
+    /* Converted once here, so that the sessions share the converted image
+     * (copy-on-write) instead of each converting it to a copy of its own.
+     * Sessions on a screen with a different format still do. */
+    if (img != NULL && same_format && format != CAIRO_FORMAT_INVALID) {
+        images_set_format(format);
+        img = images_convert(img);
     }
 }
 
 int main(int argc, char *argv[]) {
     struct passwd *pw;
     char *username;
-    char *image_path = NULL;
-    int ret;
-    struct pam_conv conv = {conv_callback, NULL};
     int curs_choice = CURS_NONE;
     int o;
     int optind = 0;
@@ -819,6 +1571,25 @@ int main(int argc, char *argv[]) {
         {"color-verify", required_argument, NULL, 0},
         {"color-bg",     required_argument, NULL, 0},
         {"color-border", required_argument, NULL, 0},
+        {"color-timeout", required_argument, NULL, 0},
+        {"auth-timeout", required_argument, NULL, 0},
+        {"daemon", no_argument, NULL, 0},
+        {"socket", required_argument, NULL, 0},
+        {"max-image-memory", required_argument, NULL, 0},
+        {"clock", no_argument, NULL, 0},
+        {"time-format", required_argument, NULL, 0},
+        {"date-format", required_argument, NULL, 0},
+        {"message", required_argument, NULL, 0},
+        {"show-keyboard-layout", no_argument, NULL, 0},
+        {"theme", required_argument, NULL, 0},
+        {"prefetch-memory", required_argument, NULL, 0},
+        {"rotate-interval", required_argument, NULL, 0},
+        {"hardened", optional_argument, NULL, 0},
+        {"raise-priority", no_argument, NULL, 0},
+        {"low-bandwidth", no_argument, NULL, 0},
+        {"composite-overlay", no_argument, NULL, 0},
+        {"ready-fd", required_argument, NULL, 0},
+        {"displays", required_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}};
 
     if ((pw = getpwuid(getuid())) == NULL)
@@ -844,23 +1615,16 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Inactivity timeout only makes sense with DPMS, which was removed. Please see the manpage i3lock(1).\n");
                 break;
             }
-            case 'c': {
-                char *arg = optarg;
-
-                /* Skip # if present */
-                if (arg[0] == '#')
-                    arg++;
-
-                if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color) != 1)
-                    errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
-
+            case 'c':
+                if (!theme_set_option("color", optarg))
+                    exit(EXIT_FAILURE);
                 break;
-            }
             case 'u':
                 unlock_indicator = false;
                 break;
             case 'i':
-                image_path = strdup(optarg);
+                if (!images_add(optarg))
+                    exit(EXIT_FAILURE);
                 break;
             case 't':
                 tile = true;
@@ -880,55 +1644,88 @@ int main(int argc, char *argv[]) {
             case 0:
                 if (strcmp(longopts[optind].name, "debug") == 0)
                     debug_mode = true;
-                else if (strcmp(longopts[optind].name, "color-icon") == 0) {
-                    char *arg = optarg;
-
-                    /* Skip # if present */
-                    if (arg[0] == '#')
-                        arg++;
-
-                    if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color_icon) != 1)
-                        errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
+                else if (strncmp(longopts[optind].name, "color-", strlen("color-")) == 0) {
+                    if (!theme_set_option(longopts[optind].name, optarg))
+                        exit(EXIT_FAILURE);
                 }
-                else if (strcmp(longopts[optind].name, "color-wrong") == 0) {
-                    char *arg = optarg;
-
-                    /* Skip # if present */
-                    if (arg[0] == '#')
-                        arg++;
-
-                    if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color_wrong) != 1)
-                        errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
+                else if (strcmp(longopts[optind].name, "theme") == 0) {
+                    theme_set_path(optarg);
                 }
-                else if (strcmp(longopts[optind].name, "color-verify") == 0) {
-                    char *arg = optarg;
-
-                    /* Skip # if present */
-                    if (arg[0] == '#')
-                        arg++;
-
-                    if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color_verify) != 1)
-                        errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
+                else if (strcmp(longopts[optind].name, "auth-timeout") == 0) {
+                    if (sscanf(optarg, "%lf", &auth_timeout) != 1 || auth_timeout < 0.0)
+                        errx(EXIT_FAILURE, "auth-timeout must be a positive number of seconds (or 0 to disable).\n");
                 }
-                else if (strcmp(longopts[optind].name, "color-bg") == 0) {
-                    char *arg = optarg;
-
-                    /* Skip # if present */
-                    if (arg[0] == '#')
-                        arg++;
-
-                    if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color_bg) != 1)
-                        errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
+                else if (strcmp(longopts[optind].name, "daemon") == 0) {
+                    daemon_mode = true;
+                    /* The daemon is a long-running process, it is up to
+                     * whoever starts it to put it into the background. */
+                    dont_fork = true;
                 }
-                else if (strcmp(longopts[optind].name, "color-border") == 0) {
-                    char *arg = optarg;
-
-                    /* Skip # if present */
-                    if (arg[0] == '#')
-                        arg++;
-
-                    if (strlen(arg) != 6 || sscanf(arg, "%06[0-9a-fA-F]", color_border) != 1)
-                        errx(EXIT_FAILURE, "color is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n");
+                else if (strcmp(longopts[optind].name, "socket") == 0) {
+                    free(socket_path);
+                    socket_path = strdup(optarg);
+                }
+                else if (strcmp(longopts[optind].name, "max-image-memory") == 0) {
+                    unsigned int mib;
+                    if (sscanf(optarg, "%u", &mib) != 1)
+                        errx(EXIT_FAILURE, "max-image-memory must be a number of MiB (or 0 for no limit).\n");
+                    max_image_memory = (size_t)mib * 1024 * 1024;
+                }
+                else if (strcmp(longopts[optind].name, "prefetch-memory") == 0) {
+                    unsigned int mib;
+                    if (sscanf(optarg, "%u", &mib) != 1)
+                        errx(EXIT_FAILURE, "prefetch-memory must be a number of MiB.\n");
+                    prefetch_memory = (size_t)mib * 1024 * 1024;
+                }
+                else if (strcmp(longopts[optind].name, "hardened") == 0) {
+                    unsigned int mib = 256;
+                    if (optarg != NULL && (sscanf(optarg, "%u", &mib) != 1 || mib == 0))
+                        errx(EXIT_FAILURE, "hardened must be given a number of MiB.\n");
+                    hardened_budget = (size_t)mib * 1024 * 1024;
+                }
+                else if (strcmp(longopts[optind].name, "displays") == 0) {
+                    char *list = strdup(optarg);
+                    for (char *display = strtok(list, ","); display != NULL; display = strtok(NULL, ",")) {
+                        displays = realloc(displays, sizeof(char *) * (num_displays + 1));
+                        if (displays == NULL)
+                            err(EXIT_FAILURE, "realloc");
+                        displays[num_displays++] = display;
+                    }
+                }
+                else if (strcmp(longopts[optind].name, "raise-priority") == 0) {
+                    raise_priority = true;
+                }
+                else if (strcmp(longopts[optind].name, "low-bandwidth") == 0) {
+                    low_bandwidth = true;
+                }
+                else if (strcmp(longopts[optind].name, "composite-overlay") == 0) {
+                    composite_overlay = true;
+                }
+                else if (strcmp(longopts[optind].name, "ready-fd") == 0) {
+                    char *endptr;
+                    long int fd = strtol(optarg, &endptr, 10);
+                    if (*optarg == '\0' || *endptr != '\0' || fd < 0 || fcntl(fd, F_GETFD) == -1)
+                        errx(EXIT_FAILURE, "ready-fd must be an open file descriptor.\n");
+                    notify_fd = fd;
+                }
+                else if (strcmp(longopts[optind].name, "rotate-interval") == 0) {
+                    if (sscanf(optarg, "%lf", &rotate_interval) != 1 || rotate_interval < 0.0)
+                        errx(EXIT_FAILURE, "rotate-interval must be a positive number of seconds (or 0 to disable).\n");
+                }
+                else if (strcmp(longopts[optind].name, "clock") == 0) {
+                    show_clock = true;
+                }
+                else if (strcmp(longopts[optind].name, "time-format") == 0) {
+                    time_format = optarg;
+                }
+                else if (strcmp(longopts[optind].name, "date-format") == 0) {
+                    date_format = optarg;
+                }
+                else if (strcmp(longopts[optind].name, "message") == 0) {
+                    text_set(TEXT_MESSAGE, optarg);
+                }
+                else if (strcmp(longopts[optind].name, "show-keyboard-layout") == 0) {
+                    show_keyboard_layout = true;
                 }
                 break;
             case 'f':
@@ -943,27 +1740,112 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             case 's':
-                if (sscanf(optarg, "%lf", &icon_scale) != 1 || icon_scale < 0.0) {
-                    errx(EXIT_FAILURE, "icon_scale must be greater than 0.\n");
-                }
+                if (!theme_set_option("icon_scale", optarg))
+                    exit(EXIT_FAILURE);
                 break;
             default:
                 errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b] [-d] [-c color] [-u] [-p win|default]"
                                    " [-i image.png] [-t] [-e] [-I timeout] [-f] [-w] [-D desaturate] [-s icon-scale]"
-                                   " --color-(icon|wrong|verify|bg|border) color");
+                                   " [--auth-timeout seconds] [--daemon] [--socket path] [--max-image-memory MiB] [--prefetch-memory MiB] [--rotate-interval seconds] [--hardened[=MiB]] [--raise-priority] [--low-bandwidth] [--composite-overlay] [--ready-fd fd] [--displays list] [--clock] [--time-format fmt] [--date-format fmt] [--message text] [--show-keyboard-layout] [--theme file] --color-(icon|wrong|verify|bg|border|timeout) color");
         }
     }
 
+    /* SIGHUP (reload the theme) and, with --daemon, SIGUSR1 (lock) would
+     * kill us until their watchers are started, after the slow part of the
+     * setup. Until then, they stay pending; libev unblocks them when the
+     * watchers are started. Threads and processes started from now on
+     * inherit the mask. */
+    sigset_t early_signals;
+    sigemptyset(&early_signals);
+    sigaddset(&early_signals, SIGHUP);
+    if (daemon_mode)
+        sigaddset(&early_signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &early_signals, NULL);
+
     /* We need (relatively) random numbers for highlighting a random part of
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
 
-    /* Initialize PAM */
-    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+    /* Errors in the theme file are fatal now, on reload the current theme is
+     * kept instead. */
+    if ((theme = theme_compile()) == NULL)
+        exit(EXIT_FAILURE);
+
+    /* Before anything big is allocated. */
+    if (hardened_budget > 0)
+        harden_init();
+
+    /* Whoever waits for us to lock the screen may be gone by the time we
+     * tell them (see notify.c), which must not kill us right after locking.
+     * The X11 connection reports a closed socket as a connection error. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Before forking, so that the processes which don’t lock the screen can
+     * drop their copies of the fds. */
+    notify_init(notify_fd);
+
+    if (num_displays > 0) {
+        /* The sessions need the privileges for their authentication
+         * helpers, so the supervisor could not drop them. */
+        if (getgid() != getegid() || getuid() != geteuid())
+            errx(EXIT_FAILURE, "--displays cannot be used when i3lock is installed setuid/setgid");
+        if (rotate_interval > 0) {
+            fprintf(stderr, "[i3lock] --rotate-interval is not supported with --displays, ignoring it\n");
+            rotate_interval = 0;
+        }
 
-    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+        preload_shared_assets();
+        /* Only returns in the sessions, which have their own socket (if
+         * any) and do not fork again. */
+        const char *display = supervisor_run(displays, num_displays);
+        if (daemon_mode && socket_path == NULL)
+            socket_path = ipc_default_socket_path();
+        if (socket_path != NULL) {
+            char *session_socket;
+            if (asprintf(&session_socket, "%s.%s", socket_path, display) == -1)
+                err(EXIT_FAILURE, "asprintf");
+            socket_path = session_socket;
+        }
+        dont_fork = true;
+    }
+
+    /* Fork now, before we allocate anything big or start the authentication
+     * helper (which needs to be our child). */
+    if (!dont_fork)
+        fork_early();
+
+    /* Initialize PAM in the authentication helper. It runs in parallel to the
+     * X11 setup below. */
+    if (!auth_helper_start(username))
+        errx(EXIT_FAILURE, "Could not start the authentication helper");
+
+    /* The helper keeps whatever privileges we were started with (e.g. when
+     * installed setuid root), the process talking to X11 does not need them. */
+    if (getgid() != getegid() || getuid() != geteuid()) {
+        if (setgid(getgid()) != 0 || setuid(getuid()) != 0)
+            err(EXIT_FAILURE, "Could not drop privileges");
+    }
+
+    /* Only for this (the main) thread, which handles input. The render
+     * thread raises its own (see render_start()), the decoding threads lower
+     * theirs. */
+    if (raise_priority)
+        harden_raise_priority();
+
+    /* Decode the image(s) in parallel to the X11 setup below. Further images
+     * are only needed if the background changes at some point. */
+    const bool use_images = (images_count() > 0);
+    /* Every frame of an animation is an image upload, which is what
+     * --low-bandwidth avoids, so only the first frame is shown then. */
+    const bool animated = (!images_preloaded && !low_bandwidth &&
+                           images_count() == 1 && animation_open(images_get(0)));
+    if (use_images && !images_preloaded)
+        images_start(max_image_memory, desaturate, prefetch_memory,
+                     daemon_mode || rotate_interval > 0);
+    /* The first frame is shown before locking, the animation starts once the
+     * screen is locked. */
+    if (animated)
+        animation_start(prefetch_memory, max_image_memory);
 
 /* Using mlock() as non-super-user seems only possible in Linux. Users of other
  * operating systems should use encrypted swap/no swap (or remove the ifdef and
@@ -976,12 +1858,44 @@ int main(int argc, char *argv[]) {
         err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
 #endif
 
+    /* The startup sequence below is ordered so that independent requests are
+     * sent before waiting for any reply, e.g. the extension queries are all
+     * sent at once, and the Xinerama and wallpaper requests are in flight
+     * while the (many) keymap round trips happen. */
+    phase_begin(PHASE_X_CONNECT);
+
     /* Double checking that connection is good and operatable with xcb */
     int screennr;
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
 
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+    xcb_prefetch_extension_data(conn, &xcb_screensaver_id);
+    if (use_wallpaper && !use_images)
+        prefetch_root_pixmap_atom(conn);
+
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+    prefetch_window_atoms(conn, screen, composite_overlay);
+
+    last_resolution[0] = screen->width_in_pixels;
+    last_resolution[1] = screen->height_in_pixels;
+
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+
+    /* To stop drawing while the display is blanked. */
+    if (!screensaver_select_input(conn, screen, &screensaver_base_event))
+        DEBUG("MIT-SCREEN-SAVER not available, cannot detect when the display is blanked\n");
+    phase_end(PHASE_X_CONNECT);
+
+    phase_begin(PHASE_SCREENS);
+    /* Only sends the requests, the replies are collected below. */
+    xinerama_init();
+    phase_end(PHASE_SCREENS);
+
+    phase_begin(PHASE_XKB);
     if (xkb_x11_setup_xkb_extension(conn,
                                     XKB_X11_MIN_MAJOR_XKB_VERSION,
                                     XKB_X11_MIN_MINOR_XKB_VERSION,
@@ -1006,9 +1920,11 @@ int main(int argc, char *argv[]) {
          XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
          XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
 
+    xkb_device_id = xkb_x11_get_core_keyboard_device_id(conn);
+
     xcb_xkb_select_events(
         conn,
-        xkb_x11_get_core_keyboard_device_id(conn),
+        xkb_device_id,
         required_events,
         0,
         required_events,
@@ -1019,100 +1935,175 @@ int main(int argc, char *argv[]) {
     /* When we cannot initially load the keymap, we better exit */
     if (!load_keymap())
         errx(EXIT_FAILURE, "Could not load keymap");
+    phase_end(PHASE_XKB);
 
-    const char *locale = getenv("LC_ALL");
-    if (!locale)
-        locale = getenv("LC_CTYPE");
-    if (!locale)
-        locale = getenv("LANG");
-    if (!locale) {
-        if (debug_mode)
-            fprintf(stderr, "Can't detect your locale, fallback to C\n");
-        locale = "C";
-    }
+    /* Loading the keymap waited for the server, so the replies prefetched
+     * for the overlay window are there. */
+    if (composite_overlay)
+        composite_overlay_init(conn);
 
-    load_compose_table(locale);
+    /* Unless the supervisor already loaded it. */
+    if (xkb_compose_table == NULL)
+        compose_locale = detect_locale();
 
-    xinerama_init();
+    phase_begin(PHASE_SCREENS);
     xinerama_query_screens();
-
-    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
-
-    last_resolution[0] = screen->width_in_pixels;
-    last_resolution[1] = screen->height_in_pixels;
-
-    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-
-    xcb_pixmap_t root_pixmap = 0;
-    if (image_path) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
-        /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
-        }
+    phase_end(PHASE_SCREENS);
+
+    phase_begin(PHASE_IMAGE_LOAD);
+    xcb_pixmap_t root_pixmap = XCB_NONE;
+    if (use_images) {
+        /* Decoded, scaled down and desaturated by the prefetch thread. In
+         * case loading failed, we just pretend no -i was specified. From now
+         * on, the images (and frames) are also converted to the format of
+         * the screen, once, instead of on every upload. */
+        images_set_format(screen_format(conn, screen));
+        if (!images_preloaded)
+            img = images_wait(&img_scale);
+        else
+            img = images_convert(img);
     }
     else if (use_wallpaper) {
-        xcb_pixmap_t root_pixmap = copy_root_pixmap(conn, screen);
-        img = cairo_xcb_surface_create(conn, root_pixmap,
-                get_root_visual_type(screen),
-                screen->width_in_pixels, screen->height_in_pixels);
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load wallpaper: %s\n",
-                    cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
+        root_pixmap = copy_root_pixmap(conn, screen);
+        if (root_pixmap == XCB_NONE) {
+            fprintf(stderr, "Could not load wallpaper: _XROOTPMAP_ID is not set\n");
+        } else {
+            img = cairo_xcb_surface_create(conn, root_pixmap,
+                    get_root_visual_type(screen),
+                    screen->width_in_pixels, screen->height_in_pixels);
+            if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+                fprintf(stderr, "Could not load wallpaper: %s\n",
+                        cairo_status_to_string(cairo_surface_status(img)));
+                img = NULL;
+            }
         }
-        /* Desaturate image */
     }
+    phase_end(PHASE_IMAGE_LOAD);
 
-    if (img && desaturate > 0.0) {
+    /* Desaturate the wallpaper, images were already desaturated by the
+     * prefetch thread. */
+    phase_begin(PHASE_EFFECTS);
+    if (!use_images && img && desaturate > 0.0) {
         cairo_t* cr = cairo_create(img);
         cairo_set_source_rgba(cr, 1, 1, 1, desaturate);
         cairo_set_operator(cr, CAIRO_OPERATOR_HSL_SATURATION);
         cairo_paint(cr);
         cairo_destroy(cr);
     }
+    phase_end(PHASE_EFFECTS);
+
+    /* Don’t lock the screen unless we will be able to unlock it again. */
+    phase_begin(PHASE_PAM_INIT);
+    if (!auth_helper_wait_ready())
+        errx(EXIT_FAILURE, "PAM initialization failed");
+    phase_end(PHASE_PAM_INIT);
+
+    if (show_clock)
+        update_clock();
+
+    /* The image (uploaded to the X server once, then freed) or our copy of
+     * the wallpaper is kept to render the background again when the
+     * resolution or the background color changes. */
+    if (root_pixmap != XCB_NONE && img != NULL) {
+        cairo_surface_flush(img);
+        set_background_source(NULL, 1.0, root_pixmap, last_resolution);
+    } else {
+        if (root_pixmap != XCB_NONE)
+            xcb_free_pixmap(conn, root_pixmap);
+        set_background_source(img, img_scale, XCB_NONE, last_resolution);
+    }
 
     /* Pixmap on which the image is rendered to (if any) */
+    phase_begin(PHASE_MAP);
     xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
 
+    DEBUG("image memory: %zu KiB client-side, ~%zu KiB server-side\n",
+          image_memory(img) / 1024,
+          /* The retained background plus the pixmap of the current frame. */
+          (size_t)(root_pixmap != XCB_NONE ? 3 : 2) * last_resolution[0] * last_resolution[1] * 4 / 1024);
+    /* The render side holds its own reference. */
+    if (img) {
+        cairo_surface_destroy(img);
+        img = NULL;
+    }
+
     /* open the fullscreen window, already with the correct pixmap in place */
-    win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
-    xcb_free_pixmap(conn, root_pixmap);
+    win = open_fullscreen_window(conn, screen, color_pixel(get_root_visual_type(screen), &theme->background), bg_pixmap);
+    /* The overlay window is then collected with the sync below. */
+    if (composite_overlay)
+        composite_overlay_update(conn, screen);
 
-    pid_t pid = fork();
-    /* The pid == -1 case is intentionally ignored here:
-     * While the child process is useful for preventing other windows from
-     * popping up while i3lock blocks, it is not critical. */
-    if (pid == 0) {
-        /* Child */
-        close(xcb_get_file_descriptor(conn));
-        maybe_close_sleep_lock_fd();
-        raise_loop(win);
-        exit(EXIT_SUCCESS);
-    }
+    /* From now on, frames are drawn by the render thread on its own
+     * connection, which needs to see the window and the pixmaps. */
+    sync_with_server(conn);
+    render_start(raise_priority, hardened_budget > 0);
 
     cursor = create_cursor(conn, screen, win, curs_choice);
 
-    grab_pointer_and_keyboard(conn, screen, cursor);
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
-
     /* Initialize the libev event loop. */
     main_loop = EV_DEFAULT;
     if (main_loop == NULL)
         errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
+    allocate_input_timers();
+    render_watch(main_loop);
+    lock_state_since = ev_time();
+
+    if (show_clock) {
+        /* Fires at the start of every minute, started by lock_screen(). */
+        clock_periodic = calloc(sizeof(struct ev_periodic), 1);
+        ev_periodic_init(clock_periodic, clock_cb, 0., 60., 0);
+    }
+
+    if (rotate_interval > 0) {
+        /* Started by lock_screen(). */
+        rotate_timer = calloc(sizeof(struct ev_timer), 1);
+        ev_timer_init(rotate_timer, rotate_cb, rotate_interval, rotate_interval);
+    }
+
+    if (animated) {
+        /* Input and redraws of the unlock indicator go first. */
+        animation_timer = calloc(sizeof(struct ev_timer), 1);
+        ev_timer_init(animation_timer, animation_cb, 0., 0.);
+        ev_set_priority(animation_timer, EV_MINPRI);
+        animation_watch(main_loop, animation_ready_cb);
+    }
+
+    /* Upload the next image as soon as it is prepared. */
+    if (use_images)
+        images_watch(main_loop, next_image_cb);
+
+    /* In --daemon mode, the window stays unmapped until a lock is requested. */
+    if (!daemon_mode)
+        lock_screen();
+
+    struct ev_signal *reload_signal = calloc(sizeof(struct ev_signal), 1);
+    ev_signal_init(reload_signal, reload_theme_cb, SIGHUP);
+    ev_signal_start(main_loop, reload_signal);
+
+    if (daemon_mode) {
+        struct ev_signal *lock_signal = calloc(sizeof(struct ev_signal), 1);
+        ev_signal_init(lock_signal, lock_signal_cb, SIGUSR1);
+        ev_signal_start(main_loop, lock_signal);
+
+        if (socket_path == NULL)
+            socket_path = ipc_default_socket_path();
+    }
+
+    /* Without --daemon, the socket is only created if asked for. */
+    if (socket_path != NULL && !ipc_init(socket_path, handle_ipc_command))
+        errx(EXIT_FAILURE, "Could not create the control socket\n");
 
     struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
     struct ev_prepare *xcb_prepare = calloc(sizeof(struct ev_prepare), 1);
+    auth_watcher = calloc(sizeof(struct ev_io), 1);
+    compose_idle = calloc(sizeof(struct ev_idle), 1);
+
+    /* Started by input_done() whenever a password is being verified. */
+    ev_io_init(auth_watcher, auth_result_cb, auth_helper_fd(), EV_READ);
+
+    /* Started on MapNotify, see ensure_compose_table(). */
+    ev_idle_init(compose_idle, compose_idle_cb);
 
     ev_io_init(xcb_watcher, xcb_got_event, xcb_get_file_descriptor(conn), EV_READ);
     ev_io_start(main_loop, xcb_watcher);
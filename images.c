@@ -0,0 +1,441 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * images.c: the images given with -i (files or directories). They are
+ *           decoded, scaled down (--max-image-memory) and desaturated (-D)
+ *           by a low-priority thread, ahead of time and in the order in which
+ *           they will be shown. The prepared images wait in a queue whose size
+ *           is bounded by --prefetch-memory, until the main thread uploads
+ *           them to the X server (see next_image_cb() in i3lock.c). Only the
+ *           main thread talks to X11.
+ *
+ *           Once the screen's pixel format is known, the images are also
+ *           converted to it (see images_set_format()), so that uploading
+ *           them does not convert every pixel again.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <cairo.h>
+#include <ev.h>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "i3lock.h"
+#include "images.h"
+
+/* Upper limit for the number of prepared images, regardless of their size. */
+#define QUEUE_SIZE 8
+
+extern bool debug_mode;
+
+static char **paths;
+static int num_paths;
+/* Index of the path which is prepared next. */
+static int next_path;
+
+/* What the thread does to every image, see images_start(). */
+static size_t max_image_bytes;
+static double desaturate_by;
+static size_t budget;
+static bool keep_going;
+
+typedef struct {
+    cairo_surface_t *surface;
+    /* The factor by which the image was downscaled. */
+    double scale;
+    size_t bytes;
+} prepared_image_t;
+
+/* Everything below is protected by queue_lock. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when an image was added to or taken from the queue, and when the
+ * thread is done. */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static prepared_image_t queue[QUEUE_SIZE];
+static int queue_head;
+static int queue_len;
+static size_t queue_bytes;
+/* The size of the last prepared image, to guess whether the next one still
+ * fits into the budget. */
+static size_t last_bytes;
+static bool thread_done;
+static struct ev_loop *ready_loop;
+static struct ev_async *ready_watcher;
+
+static images_ready_callback_t ready_callback;
+
+/* The format which the images are converted to (see images_convert()).
+ * Protected by format_lock, because it is only known once the main thread
+ * connected to X11, when the threads are already running. */
+static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+static cairo_format_t target_format = CAIRO_FORMAT_INVALID;
+
+static bool has_png_suffix(const char *name) {
+    size_t len = strlen(name);
+    return (len > 4 && strcasecmp(name + len - 4, ".png") == 0);
+}
+
+static void add_path(char *path) {
+    paths = realloc(paths, sizeof(char *) * (num_paths + 1));
+    if (paths == NULL)
+        err(EXIT_FAILURE, "realloc");
+    paths[num_paths++] = path;
+}
+
+/*
+ * Adds the given image, or all PNG images in the given directory. Returns
+ * false (after printing why) if the directory cannot be read.
+ *
+ */
+bool images_add(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        /* Errors are reported when loading the image. */
+        add_path(strdup(path));
+        return true;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "[i3lock] Could not open directory \"%s\": %s\n", path, strerror(errno));
+        return false;
+    }
+
+    int before = num_paths;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !has_png_suffix(entry->d_name))
+            continue;
+        char *file;
+        if (asprintf(&file, "%s/%s", path, entry->d_name) == -1)
+            err(EXIT_FAILURE, "asprintf");
+        add_path(file);
+    }
+    closedir(dir);
+
+    if (num_paths == before)
+        fprintf(stderr, "[i3lock] No PNG images in \"%s\"\n", path);
+    return true;
+}
+
+int images_count(void) {
+    return num_paths;
+}
+
+/*
+ * Returns the path of the given image. Only valid before images_start().
+ *
+ */
+const char *images_get(int index) {
+    return paths[index];
+}
+
+/*
+ * Returns the number of bytes the given image occupies in our memory (not
+ * counting images which live on the X server, e.g. the wallpaper).
+ *
+ */
+size_t image_memory(cairo_surface_t *surface) {
+    if (surface == NULL || cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+        return 0;
+    return (size_t)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+}
+
+/*
+ * Returns a copy of the given image, scaled down by the given factor, and
+ * destroys the original.
+ *
+ */
+static cairo_surface_t *downscale_image(cairo_surface_t *source, double factor) {
+    int width = ceil(cairo_image_surface_get_width(source) * factor);
+    int height = ceil(cairo_image_surface_get_height(source) * factor);
+    cairo_surface_t *scaled = cairo_image_surface_create(cairo_image_surface_get_format(source), width, height);
+
+    cairo_t *cr = cairo_create(scaled);
+    cairo_scale(cr, factor, factor);
+    cairo_set_source_surface(cr, source, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    cairo_surface_destroy(source);
+    return scaled;
+}
+
+/*
+ * Sets the format of the screen (see screen_format()), which all images are
+ * converted to from now on.
+ *
+ */
+void images_set_format(cairo_format_t format) {
+    pthread_mutex_lock(&format_lock);
+    target_format = format;
+    pthread_mutex_unlock(&format_lock);
+}
+
+/*
+ * Converts the given image to the format set with images_set_format(), if
+ * any, replacing the original. The formats of screens have no alpha channel,
+ * so transparent images are left as they are: they are painted onto the
+ * background color when rendering, which picks up a new color (e.g. after
+ * a theme reload).
+ *
+ */
+cairo_surface_t *images_convert(cairo_surface_t *img) {
+    pthread_mutex_lock(&format_lock);
+    cairo_format_t format = target_format;
+    pthread_mutex_unlock(&format_lock);
+
+    if (img == NULL || format == CAIRO_FORMAT_INVALID ||
+        cairo_image_surface_get_format(img) == format ||
+        cairo_surface_get_content(img) != CAIRO_CONTENT_COLOR)
+        return img;
+
+    cairo_surface_t *converted = cairo_image_surface_create(format,
+                                                            cairo_image_surface_get_width(img),
+                                                            cairo_image_surface_get_height(img));
+    cairo_t *cr = cairo_create(converted);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, img, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(converted);
+
+    cairo_surface_destroy(img);
+    return converted;
+}
+
+/*
+ * Scales the given (decoded) image down to fit --max-image-memory,
+ * desaturates it and converts it to the screen's format (if known yet),
+ * replacing the original. Also used for the frames of animations, see
+ * animation.c.
+ *
+ */
+cairo_surface_t *images_apply_effects(cairo_surface_t *img, const char *path, double *scale) {
+    *scale = 1.0;
+    size_t bytes = image_memory(img);
+    if (max_image_bytes > 0 && bytes > max_image_bytes) {
+        /* The memory needed shrinks with the square of the factor. */
+        *scale = sqrt((double)max_image_bytes / (double)bytes);
+        img = downscale_image(img, *scale);
+        DEBUG("image \"%s\" needs %zu KiB, more than --max-image-memory, downscaled by %.2f to %zu KiB\n",
+              path, bytes / 1024, *scale, image_memory(img) / 1024);
+    }
+
+    if (desaturate_by > 0.0) {
+        cairo_t *cr = cairo_create(img);
+        cairo_set_source_rgba(cr, 1, 1, 1, desaturate_by);
+        cairo_set_operator(cr, CAIRO_OPERATOR_HSL_SATURATION);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+    }
+
+    /* Make sure all drawing is done before the image changes threads. */
+    cairo_surface_flush(img);
+    return images_convert(img);
+}
+
+/*
+ * Decodes the given image and applies the effects. Returns NULL (after
+ * printing why) if the image cannot be loaded. Runs on the thread.
+ *
+ */
+static cairo_surface_t *prepare_image(const char *path, double *scale) {
+    cairo_surface_t *img = cairo_image_surface_create_from_png(path);
+    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not load image \"%s\": %s\n",
+                path, cairo_status_to_string(cairo_surface_status(img)));
+        cairo_surface_destroy(img);
+        return NULL;
+    }
+    return images_apply_effects(img, path, scale);
+}
+
+/*
+ * Lowers the priority of the calling thread, so that decoding does not
+ * compete with the main thread (or anything else) for CPU time.
+ *
+ */
+void images_lower_priority(void) {
+#if defined(__linux__)
+    /* On Linux, the nice value is per thread. */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) != 0)
+        DEBUG("could not lower the priority of the decoding thread: %s\n", strerror(errno));
+#endif
+}
+
+/*
+ * Whether the thread has to wait before preparing another image. At least
+ * one image is always prepared, even if it alone exceeds the budget.
+ *
+ */
+static bool queue_full(void) {
+    return (queue_len == QUEUE_SIZE ||
+            (queue_len > 0 && queue_bytes + last_bytes > budget));
+}
+
+static void *prefetch_thread(void *arg) {
+    images_lower_priority();
+
+    pthread_mutex_lock(&queue_lock);
+    while (num_paths > 0) {
+        while (queue_full())
+            pthread_cond_wait(&queue_cond, &queue_lock);
+
+        int index = next_path;
+        char *path = paths[index];
+        pthread_mutex_unlock(&queue_lock);
+
+        double scale;
+        double start = ev_time();
+        cairo_surface_t *img = prepare_image(path, &scale);
+
+        pthread_mutex_lock(&queue_lock);
+        if (img == NULL) {
+            /* Don’t try this one again. */
+            free(path);
+            memmove(&paths[index], &paths[index + 1], sizeof(char *) * (num_paths - index - 1));
+            num_paths--;
+            if (next_path >= num_paths)
+                next_path = 0;
+            continue;
+        }
+
+        prepared_image_t *prepared = &queue[(queue_head + queue_len) % QUEUE_SIZE];
+        prepared->surface = img;
+        prepared->scale = scale;
+        prepared->bytes = image_memory(img);
+        queue_len++;
+        queue_bytes += prepared->bytes;
+        last_bytes = prepared->bytes;
+        next_path = (next_path + 1) % num_paths;
+        DEBUG("prepared image \"%s\" in %.1f ms, %d queued (%zu KiB)\n",
+              path, (ev_time() - start) * 1000, queue_len, queue_bytes / 1024);
+
+        pthread_cond_broadcast(&queue_cond);
+        if (ready_watcher != NULL)
+            ev_async_send(ready_loop, ready_watcher);
+
+        /* Showing the same image again does not need another copy. */
+        if (!keep_going || num_paths == 1)
+            break;
+    }
+    thread_done = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/*
+ * Starts preparing the images, in a random order. Unless rotate is true,
+ * only the first image is prepared.
+ *
+ */
+void images_start(size_t max_bytes, double desaturation, size_t prefetch_budget, bool rotate) {
+    max_image_bytes = max_bytes;
+    desaturate_by = desaturation;
+    budget = prefetch_budget;
+    keep_going = rotate;
+
+    /* Fisher–Yates, so that every image is shown once before any is repeated. */
+    for (int i = num_paths - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        char *tmp = paths[i];
+        paths[i] = paths[j];
+        paths[j] = tmp;
+    }
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, prefetch_thread, NULL);
+    if (error != 0)
+        errx(EXIT_FAILURE, "Could not start the prefetch thread: %s", strerror(error));
+    pthread_detach(thread);
+}
+
+/*
+ * Takes the oldest prepared image from the queue, if any. Must be called with
+ * queue_lock held.
+ *
+ */
+static cairo_surface_t *dequeue(double *scale) {
+    if (queue_len == 0)
+        return NULL;
+
+    prepared_image_t *prepared = &queue[queue_head];
+    cairo_surface_t *img = prepared->surface;
+    *scale = prepared->scale;
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_len--;
+    queue_bytes -= prepared->bytes;
+    pthread_cond_broadcast(&queue_cond);
+    return img;
+}
+
+/*
+ * Returns the next prepared image, waiting for the thread if necessary. Only
+ * used at startup, when there is nothing else to show yet. Returns NULL if
+ * none of the images could be loaded.
+ *
+ */
+cairo_surface_t *images_wait(double *scale) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == 0 && !thread_done)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    cairo_surface_t *img = dequeue(scale);
+    pthread_mutex_unlock(&queue_lock);
+    /* In case it was prepared before the format was known. */
+    return images_convert(img);
+}
+
+/*
+ * Returns the next prepared image, or NULL if there is none (yet). The caller
+ * owns the image.
+ *
+ */
+cairo_surface_t *images_take(double *scale) {
+    pthread_mutex_lock(&queue_lock);
+    cairo_surface_t *img = dequeue(scale);
+    pthread_mutex_unlock(&queue_lock);
+    return images_convert(img);
+}
+
+static void ready_cb(EV_P_ ev_async *w, int revents) {
+    ready_callback();
+}
+
+/*
+ * Calls the given callback from the event loop whenever an image was
+ * prepared, and once right away for the images prepared so far.
+ *
+ */
+void images_watch(struct ev_loop *loop, images_ready_callback_t callback) {
+    ready_callback = callback;
+
+    struct ev_async *watcher = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(watcher, ready_cb);
+    ev_async_start(loop, watcher);
+
+    pthread_mutex_lock(&queue_lock);
+    ready_loop = loop;
+    ready_watcher = watcher;
+    pthread_mutex_unlock(&queue_lock);
+
+    callback();
+}
@@ -0,0 +1,24 @@
+#ifndef _IMAGES_H
+#define _IMAGES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <cairo.h>
+#include <ev.h>
+
+typedef void (*images_ready_callback_t)(void);
+
+bool images_add(const char *path);
+int images_count(void);
+const char *images_get(int index);
+void images_start(size_t max_bytes, double desaturation, size_t prefetch_budget, bool rotate);
+cairo_surface_t *images_wait(double *scale);
+cairo_surface_t *images_take(double *scale);
+void images_watch(struct ev_loop *loop, images_ready_callback_t callback);
+size_t image_memory(cairo_surface_t *surface);
+void images_set_format(cairo_format_t format);
+cairo_surface_t *images_convert(cairo_surface_t *img);
+cairo_surface_t *images_apply_effects(cairo_surface_t *img, const char *path, double *scale);
+void images_lower_priority(void);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * ipc.c: a Unix domain socket on which i3lock accepts line-based commands,
+ *        e.g. “lock” in --daemon mode. The listening socket and the client
+ *        connections are ev_io watchers in the main loop, so nothing happens
+ *        as long as nobody connects.
+ *
+ *        After “subscribe”, a client also receives events (e.g. “locked
+ *        1700000000.123”, see ipc_publish()) until it disconnects.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "ipc.h"
+
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
+
+/* Commands are short, longer lines are discarded. */
+#define IPC_LINE_MAX 128
+
+typedef struct ipc_client {
+    struct ev_io watcher;
+    char line[IPC_LINE_MAX];
+    size_t len;
+    /* Set when the current line was too long and is being skipped. */
+    bool overflow;
+    /* Subscribed clients are in the subscribers list. */
+    bool subscribed;
+    struct ipc_client *next_subscriber;
+    /* Clients waiting for a reply are in the waiting list. */
+    bool waiting;
+    struct ipc_client *next_waiting;
+} ipc_client_t;
+
+/* Returned by the command handler to send the reply later. */
+const char IPC_REPLY_LATER[] = "";
+
+static char *socket_path;
+/* Forked children (e.g. the authentication helper) must not remove the
+ * socket when they exit. */
+static pid_t socket_owner;
+static struct ev_io *listen_watcher;
+static ipc_command_handler_t command_handler;
+static ipc_client_t *subscribers;
+static ipc_client_t *waiting;
+
+/*
+ * Returns the socket path to use when none was specified:
+ * $XDG_RUNTIME_DIR/i3lock.sock, or /tmp/i3lock-<uid>.sock.
+ *
+ */
+char *ipc_default_socket_path(void) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char *path;
+    int ret;
+
+    if (dir != NULL && *dir != '\0')
+        ret = asprintf(&path, "%s/i3lock.sock", dir);
+    else
+        ret = asprintf(&path, "/tmp/i3lock-%d.sock", (int)getuid());
+
+    return (ret == -1 ? NULL : path);
+}
+
+/*
+ * Writes the reply to the client. Replies are tiny, so if the client does not
+ * read them, we just drop them instead of buffering.
+ *
+ */
+static void ipc_reply(ipc_client_t *client, const char *reply) {
+    char buffer[IPC_LINE_MAX + 1];
+    int len = snprintf(buffer, sizeof(buffer), "%s\n", reply);
+    if (len < 0 || (size_t)len >= sizeof(buffer))
+        return;
+    (void)send(client->watcher.fd, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void ipc_client_free(ipc_client_t *client) {
+    if (client->subscribed) {
+        for (ipc_client_t **link = &subscribers; *link != NULL; link = &((*link)->next_subscriber)) {
+            if (*link == client) {
+                *link = client->next_subscriber;
+                break;
+            }
+        }
+    }
+    if (client->waiting) {
+        for (ipc_client_t **link = &waiting; *link != NULL; link = &((*link)->next_waiting)) {
+            if (*link == client) {
+                *link = client->next_waiting;
+                break;
+            }
+        }
+    }
+    ev_io_stop(main_loop, &(client->watcher));
+    close(client->watcher.fd);
+    free(client);
+}
+
+static void ipc_client_cb(EV_P_ ev_io *w, int revents) {
+    ipc_client_t *client = (ipc_client_t *)w;
+    char buffer[IPC_LINE_MAX];
+    ssize_t n = recv(w->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if (n <= 0) {
+        ipc_client_free(client);
+        return;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (buffer[i] != '\n') {
+            if (client->len < sizeof(client->line) - 1)
+                client->line[client->len++] = buffer[i];
+            else
+                client->overflow = true;
+            continue;
+        }
+
+        client->line[client->len] = '\0';
+        if (client->overflow) {
+            ipc_reply(client, "error: line too long");
+        } else if (strcmp(client->line, "subscribe") == 0) {
+            DEBUG("IPC client subscribed\n");
+            if (!client->subscribed) {
+                client->subscribed = true;
+                client->next_subscriber = subscribers;
+                subscribers = client;
+            }
+            ipc_reply(client, "ok");
+        } else {
+            DEBUG("IPC command \"%s\"\n", client->line);
+            const char *reply = command_handler(client->line);
+            if (reply == IPC_REPLY_LATER) {
+                if (!client->waiting) {
+                    client->waiting = true;
+                    client->next_waiting = waiting;
+                    waiting = client;
+                }
+            } else
+                ipc_reply(client, (reply != NULL ? reply : "error: unknown command"));
+        }
+        client->len = 0;
+        client->overflow = false;
+    }
+}
+
+/*
+ * Sends the given event, with the current time, to all subscribed clients.
+ * Events are not buffered: a client which does not keep up is disconnected,
+ * so that it notices and can query the state again.
+ *
+ */
+void ipc_publish(const char *event) {
+    if (subscribers == NULL)
+        return;
+
+    char buffer[IPC_LINE_MAX + 1];
+    int len = snprintf(buffer, sizeof(buffer), "%s %.3f\n", event, ev_time());
+    if (len < 0 || (size_t)len >= sizeof(buffer))
+        return;
+
+    DEBUG("IPC event \"%s\"\n", event);
+    ipc_client_t *next;
+    for (ipc_client_t *client = subscribers; client != NULL; client = next) {
+        next = client->next_subscriber;
+        if (send(client->watcher.fd, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+            ipc_client_free(client);
+    }
+}
+
+/*
+ * Sends the given reply to all clients waiting for one, see IPC_REPLY_LATER.
+ *
+ */
+void ipc_reply_waiting(const char *reply) {
+    ipc_client_t *next;
+    for (ipc_client_t *client = waiting; client != NULL; client = next) {
+        next = client->next_waiting;
+        client->waiting = false;
+        ipc_reply(client, reply);
+    }
+    waiting = NULL;
+}
+
+static void ipc_accept_cb(EV_P_ ev_io *w, int revents) {
+    int fd = accept(w->fd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    ipc_client_t *client = calloc(sizeof(ipc_client_t), 1);
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+
+    ev_io_init(&(client->watcher), ipc_client_cb, fd, EV_READ);
+    ev_io_start(main_loop, &(client->watcher));
+}
+
+static void ipc_cleanup(void) {
+    if (socket_path != NULL && getpid() == socket_owner)
+        unlink(socket_path);
+}
+
+/*
+ * Creates the socket at the given path and starts accepting connections.
+ * Refuses to replace the socket of another running instance, or anything
+ * which is not a socket at all.
+ *
+ */
+bool ipc_init(const char *path, ipc_command_handler_t handler) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[i3lock] socket path \"%s\" is too long\n", path);
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    /* Never unlink anything but a socket: a typo in the path must not cost
+     * the user a file. */
+    struct stat st;
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "[i3lock] \"%s\" exists and is not a socket\n", path);
+        return false;
+    }
+
+    /* If we can connect to an existing socket, another instance is using it.
+     * Otherwise it is stale and can be replaced. */
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "[i3lock] another instance is listening on \"%s\"\n", path);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return false;
+    }
+
+    mode_t old_umask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (ret != 0 || listen(fd, 8) != 0) {
+        perror("bind/listen");
+        close(fd);
+        return false;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    socket_path = strdup(path);
+    socket_owner = getpid();
+    command_handler = handler;
+    atexit(ipc_cleanup);
+
+    listen_watcher = calloc(sizeof(struct ev_io), 1);
+    ev_io_init(listen_watcher, ipc_accept_cb, fd, EV_READ);
+    ev_io_start(main_loop, listen_watcher);
+
+    DEBUG("listening on %s\n", path);
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef _IPC_H
+#define _IPC_H
+
+#include <stdbool.h>
+
+/* Handles one command (a line without the newline) received on the socket.
+ * Returns the reply (without the newline), NULL for unknown commands, or
+ * IPC_REPLY_LATER if the reply is sent later with ipc_reply_waiting(). */
+typedef const char *(*ipc_command_handler_t)(const char *command);
+
+extern const char IPC_REPLY_LATER[];
+
+char *ipc_default_socket_path(void);
+bool ipc_init(const char *path, ipc_command_handler_t handler);
+void ipc_publish(const char *event);
+void ipc_reply_waiting(const char *reply);
+
+#endif
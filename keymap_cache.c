@@ -0,0 +1,167 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * keymap_cache.c: caches compiled XKB keymaps, keyed by a hash of the
+ *                 server’s description of the keymap. Fetching that
+ *                 description takes a single round trip, whereas
+ *                 xkb_x11_keymap_new_from_device() issues a whole series of
+ *                 requests and then builds the keymap from scratch. Layout
+ *                 switches (setxkbmap us, setxkbmap de, …) thus only pay
+ *                 for compiling a keymap the first time.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <xcb/xcb.h>
+#include <xcb/xkb.h>
+#include <xkbcommon/xkbcommon.h>
+#include <xkbcommon/xkbcommon-x11.h>
+
+#include "i3lock.h"
+#include "keymap_cache.h"
+
+extern bool debug_mode;
+
+#define CACHE_SIZE 4
+
+static struct {
+    uint64_t hash;
+    struct xkb_keymap *keymap;
+    /* Value of use_counter when this entry was last used, 0 = empty. */
+    unsigned int last_use;
+} cache[CACHE_SIZE];
+
+static unsigned int use_counter;
+
+/*
+ * FNV-1a over the given reply, skipping the sequence number (which differs
+ * between otherwise identical replies).
+ *
+ */
+static uint64_t hash_reply(uint64_t hash, const void *reply) {
+    const uint8_t *bytes = reply;
+    const xcb_generic_reply_t *header = reply;
+    size_t len = 32 + (size_t)header->length * 4;
+
+    for (size_t i = 4; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* The requests whose replies are hashed, see request_keymap_hash(). */
+typedef struct {
+    xcb_xkb_get_map_cookie_t map;
+    xcb_xkb_get_names_cookie_t names;
+} hash_cookies_t;
+
+/*
+ * Sends the requests for the server’s description of the keymap of the given
+ * device. The replies are collected with keymap_hash().
+ *
+ */
+static hash_cookies_t request_keymap_hash(xcb_connection_t *conn, int32_t device_id) {
+    static const uint16_t map_parts =
+        (XCB_XKB_MAP_PART_KEY_TYPES |
+         XCB_XKB_MAP_PART_KEY_SYMS |
+         XCB_XKB_MAP_PART_MODIFIER_MAP |
+         XCB_XKB_MAP_PART_EXPLICIT_COMPONENTS |
+         XCB_XKB_MAP_PART_KEY_ACTIONS |
+         XCB_XKB_MAP_PART_KEY_BEHAVIORS |
+         XCB_XKB_MAP_PART_VIRTUAL_MODS |
+         XCB_XKB_MAP_PART_VIRTUAL_MOD_MAP);
+
+    static const uint32_t name_details =
+        (XCB_XKB_NAME_DETAIL_KEYCODES |
+         XCB_XKB_NAME_DETAIL_SYMBOLS |
+         XCB_XKB_NAME_DETAIL_TYPES |
+         XCB_XKB_NAME_DETAIL_COMPAT |
+         XCB_XKB_NAME_DETAIL_KEY_NAMES |
+         XCB_XKB_NAME_DETAIL_VIRTUAL_MOD_NAMES |
+         XCB_XKB_NAME_DETAIL_GROUP_NAMES);
+
+    hash_cookies_t cookies;
+    cookies.map = xcb_xkb_get_map(
+        conn, device_id, map_parts, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    cookies.names = xcb_xkb_get_names(conn, device_id, name_details);
+    return cookies;
+}
+
+/*
+ * Returns a hash of the replies to the requests sent by
+ * request_keymap_hash(), or 0 if the keymap could not be determined.
+ *
+ */
+static uint64_t keymap_hash(xcb_connection_t *conn, hash_cookies_t cookies) {
+    xcb_xkb_get_map_reply_t *map_reply = xcb_xkb_get_map_reply(conn, cookies.map, NULL);
+    xcb_xkb_get_names_reply_t *names_reply = xcb_xkb_get_names_reply(conn, cookies.names, NULL);
+
+    uint64_t hash = 0;
+    if (map_reply && names_reply) {
+        hash = 0xcbf29ce484222325ULL;
+        hash = hash_reply(hash, map_reply);
+        hash = hash_reply(hash, names_reply);
+    }
+
+    free(map_reply);
+    free(names_reply);
+    return hash;
+}
+
+/*
+ * Returns the keymap the server currently uses for the given device (the
+ * caller owns the returned reference), or NULL on error.
+ *
+ */
+struct xkb_keymap *keymap_cache_get(struct xkb_context *ctx, xcb_connection_t *conn, int32_t device_id) {
+    /* The description is requested before the keymap is compiled and again
+     * afterwards, see below. */
+    hash_cookies_t cookies = request_keymap_hash(conn, device_id);
+    uint64_t hash = 0;
+    int victim = 0;
+
+    /* With an empty cache (e.g. at startup), there is nothing to look up, so
+     * we don’t wait for the hash before compiling. Its replies arrive while
+     * the keymap is fetched. */
+    if (use_counter > 0 && (hash = keymap_hash(conn, cookies)) != 0) {
+        for (int i = 0; i < CACHE_SIZE; i++) {
+            if (cache[i].last_use != 0 && cache[i].hash == hash) {
+                DEBUG("keymap cache hit (hash %016llx)\n", (unsigned long long)hash);
+                cache[i].last_use = ++use_counter;
+                return xkb_keymap_ref(cache[i].keymap);
+            }
+            if (cache[i].last_use < cache[victim].last_use)
+                victim = i;
+        }
+    }
+
+    DEBUG("keymap cache miss, compiling\n");
+    struct xkb_keymap *keymap = xkb_x11_keymap_new_from_device(ctx, conn, device_id, 0);
+    if (use_counter == 0)
+        hash = keymap_hash(conn, cookies);
+    if (keymap == NULL || hash == 0)
+        return keymap;
+
+    /* The keymap may have changed between the hash and the compile (e.g.
+     * during a burst of setxkbmap), in which case the compiled keymap is not
+     * the one the hash describes and must not be cached under it. Only a
+     * miss pays for this round trip. The keymap is still used: a MapNotify
+     * for the change is on its way and loads the current one. */
+    uint64_t compiled_hash = keymap_hash(conn, request_keymap_hash(conn, device_id));
+    if (compiled_hash != hash) {
+        DEBUG("keymap changed while compiling, not caching it\n");
+        return keymap;
+    }
+
+    xkb_keymap_unref(cache[victim].keymap);
+    cache[victim].hash = hash;
+    cache[victim].keymap = xkb_keymap_ref(keymap);
+    cache[victim].last_use = ++use_counter;
+    return keymap;
+}
@@ -0,0 +1,9 @@
+#ifndef _KEYMAP_CACHE_H
+#define _KEYMAP_CACHE_H
+
+#include <xcb/xcb.h>
+#include <xkbcommon/xkbcommon.h>
+
+struct xkb_keymap *keymap_cache_get(struct xkb_context *ctx, xcb_connection_t *conn, int32_t device_id);
+
+#endif
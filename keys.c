@@ -0,0 +1,96 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * keys.c: what key presses do, independent of X11. The special keys are
+ *         looked up in a table instead of being spread over handle_key_press(),
+ *         and the modifiers are tracked as a bitmask, computed from the
+ *         modifier indices of the current keymap. The indices are resolved
+ *         once per keymap, not by name on every key press.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "keys.h"
+
+static const struct {
+    xkb_keysym_t keysym;
+    /* The modifiers which need to be active, e.g. KEY_MOD_CTRL for C-u. */
+    unsigned int modifiers;
+    key_action_t action;
+} special_keys[] = {
+    {XKB_KEY_Return, 0, KEY_ACTION_SUBMIT},
+    {XKB_KEY_KP_Enter, 0, KEY_ACTION_SUBMIT},
+    {XKB_KEY_XF86ScreenSaver, 0, KEY_ACTION_SUBMIT},
+    {XKB_KEY_j, KEY_MOD_CTRL, KEY_ACTION_SUBMIT},
+    {XKB_KEY_Escape, 0, KEY_ACTION_CLEAR},
+    {XKB_KEY_u, KEY_MOD_CTRL, KEY_ACTION_CLEAR},
+    /* Deleting forward doesn’t make sense, as i3lock doesn’t allow you to
+     * move the cursor when entering a password. We need to eat this key
+     * press so that it won’t be treated as part of the password, see issue
+     * #50. */
+    {XKB_KEY_Delete, 0, KEY_ACTION_IGNORE},
+    {XKB_KEY_KP_Delete, 0, KEY_ACTION_IGNORE},
+    {XKB_KEY_BackSpace, 0, KEY_ACTION_ERASE},
+    {XKB_KEY_h, KEY_MOD_CTRL, KEY_ACTION_ERASE},
+};
+
+/* The indices of the modifiers in the current keymap, XKB_MOD_INVALID if it
+ * does not have them. */
+static xkb_mod_index_t ctrl_index = XKB_MOD_INVALID;
+static xkb_mod_index_t caps_index = XKB_MOD_INVALID;
+
+/*
+ * Resolves the modifier indices of the given keymap. Needs to be called
+ * whenever the keymap changes.
+ *
+ */
+void keys_set_keymap(struct xkb_keymap *keymap) {
+    ctrl_index = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CTRL);
+    caps_index = xkb_keymap_mod_get_index(keymap, XKB_MOD_NAME_CAPS);
+}
+
+/*
+ * Returns the modifiers (see key_modifier_t) which are active in the given
+ * state. Called whenever the state changes, so that key presses only need to
+ * look at the result.
+ *
+ */
+unsigned int keys_modifiers(struct xkb_state *state) {
+    unsigned int modifiers = 0;
+
+    if (ctrl_index != XKB_MOD_INVALID &&
+        xkb_state_mod_index_is_active(state, ctrl_index, XKB_STATE_MODS_DEPRESSED) > 0)
+        modifiers |= KEY_MOD_CTRL;
+    if (caps_index != XKB_MOD_INVALID &&
+        xkb_state_mod_index_is_active(state, caps_index, XKB_STATE_MODS_EFFECTIVE) > 0)
+        modifiers |= KEY_MOD_CAPS;
+    return modifiers;
+}
+
+/*
+ * Returns what pressing the key with the given keysym does while the given
+ * modifiers are active.
+ *
+ */
+key_action_t keys_classify(xkb_keysym_t ksym, unsigned int modifiers) {
+    for (size_t i = 0; i < sizeof(special_keys) / sizeof(special_keys[0]); i++) {
+        if (special_keys[i].keysym == ksym &&
+            (modifiers & special_keys[i].modifiers) == special_keys[i].modifiers)
+            return special_keys[i].action;
+    }
+    return KEY_ACTION_INPUT;
+}
+
+/*
+ * Whether the key with the given keysym starts a compose sequence, i.e. is a
+ * dead key or the Multi_key, so that the compose table is needed.
+ *
+ */
+bool keys_starts_compose(xkb_keysym_t ksym) {
+    return ksym == XKB_KEY_Multi_key ||
+           (ksym >= XKB_KEY_dead_grave && ksym <= XKB_KEY_dead_longsolidusoverlay);
+}
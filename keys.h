@@ -0,0 +1,33 @@
+#ifndef _KEYS_H
+#define _KEYS_H
+
+#include <stdbool.h>
+#include <xkbcommon/xkbcommon.h>
+
+/* The last of the dead keys (which start at XKB_KEY_dead_grave), missing from
+ * older xkbcommon headers. */
+#ifndef XKB_KEY_dead_longsolidusoverlay
+#define XKB_KEY_dead_longsolidusoverlay 0xfe93
+#endif
+
+/* The modifiers which matter to i3lock, as a bitmask (see keys_modifiers()). */
+typedef enum {
+    KEY_MOD_CTRL = (1 << 0), /* depressed */
+    KEY_MOD_CAPS = (1 << 1)  /* effective, i.e. also locked */
+} key_modifier_t;
+
+/* What a key press does to the password, see keys_classify(). */
+typedef enum {
+    KEY_ACTION_INPUT = 0, /* the key’s text (if any) is appended */
+    KEY_ACTION_SUBMIT,    /* the password is verified */
+    KEY_ACTION_CLEAR,     /* the password is cleared */
+    KEY_ACTION_ERASE,     /* the last character is removed */
+    KEY_ACTION_IGNORE     /* the key is eaten */
+} key_action_t;
+
+void keys_set_keymap(struct xkb_keymap *keymap);
+unsigned int keys_modifiers(struct xkb_state *state);
+key_action_t keys_classify(xkb_keysym_t ksym, unsigned int modifiers);
+bool keys_starts_compose(xkb_keysym_t ksym);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * keys_test.c: drives keys.c with synthetic keysyms and modifier states, see
+ *              “make check”. The keymap is compiled from a string, so that no
+ *              X11 connection (or installed keymap data) is needed.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "keys.h"
+
+/* The evdev keycodes plus 8, as in X11. */
+#define KEYCODE_LCTL 37
+#define KEYCODE_CAPS 66
+
+static const char *keymap_string =
+    "xkb_keymap {\n"
+    "    xkb_keycodes \"test\" {\n"
+    "        minimum = 8;\n"
+    "        maximum = 255;\n"
+    "        <LCTL> = 37;\n"
+    "        <CAPS> = 66;\n"
+    "    };\n"
+    "    xkb_types \"test\" {\n"
+    "        type \"ONE_LEVEL\" {\n"
+    "            modifiers = none;\n"
+    "            level_name[Level1] = \"Any\";\n"
+    "        };\n"
+    "    };\n"
+    "    xkb_compatibility \"test\" {\n"
+    "        interpret Control_L { action = SetMods(modifiers = Control); };\n"
+    "        interpret Caps_Lock { action = LockMods(modifiers = Lock); };\n"
+    "    };\n"
+    "    xkb_symbols \"test\" {\n"
+    "        key <LCTL> { [ Control_L ] };\n"
+    "        key <CAPS> { [ Caps_Lock ] };\n"
+    "        modifier_map Control { <LCTL> };\n"
+    "        modifier_map Lock { <CAPS> };\n"
+    "    };\n"
+    "};\n";
+
+static int failures = 0;
+
+static const char *action_names[] = {
+    [KEY_ACTION_INPUT] = "input",
+    [KEY_ACTION_SUBMIT] = "submit",
+    [KEY_ACTION_CLEAR] = "clear",
+    [KEY_ACTION_ERASE] = "erase",
+    [KEY_ACTION_IGNORE] = "ignore",
+};
+
+static void expect_action(const char *what, xkb_keysym_t ksym, unsigned int modifiers, key_action_t expected) {
+    key_action_t action = keys_classify(ksym, modifiers);
+    if (action == expected)
+        return;
+    fprintf(stderr, "FAIL: %s: expected %s, got %s\n", what, action_names[expected], action_names[action]);
+    failures++;
+}
+
+static void expect_modifiers(const char *what, struct xkb_state *state, unsigned int expected) {
+    unsigned int modifiers = keys_modifiers(state);
+    if (modifiers == expected)
+        return;
+    fprintf(stderr, "FAIL: %s: expected modifiers 0x%x, got 0x%x\n", what, expected, modifiers);
+    failures++;
+}
+
+static void test_classify(void) {
+    expect_action("Return", XKB_KEY_Return, 0, KEY_ACTION_SUBMIT);
+    expect_action("KP_Enter", XKB_KEY_KP_Enter, 0, KEY_ACTION_SUBMIT);
+    expect_action("C-j", XKB_KEY_j, KEY_MOD_CTRL, KEY_ACTION_SUBMIT);
+    expect_action("Escape", XKB_KEY_Escape, 0, KEY_ACTION_CLEAR);
+    expect_action("C-u", XKB_KEY_u, KEY_MOD_CTRL, KEY_ACTION_CLEAR);
+    expect_action("BackSpace", XKB_KEY_BackSpace, 0, KEY_ACTION_ERASE);
+    expect_action("C-h", XKB_KEY_h, KEY_MOD_CTRL, KEY_ACTION_ERASE);
+    expect_action("Delete", XKB_KEY_Delete, 0, KEY_ACTION_IGNORE);
+
+    expect_action("j", XKB_KEY_j, 0, KEY_ACTION_INPUT);
+    expect_action("u", XKB_KEY_u, 0, KEY_ACTION_INPUT);
+    expect_action("h", XKB_KEY_h, 0, KEY_ACTION_INPUT);
+    /* Caps Lock alone does not make letters special. */
+    expect_action("Caps j", XKB_KEY_j, KEY_MOD_CAPS, KEY_ACTION_INPUT);
+    /* Other modifiers don’t get in the way. */
+    expect_action("Caps C-u", XKB_KEY_u, KEY_MOD_CTRL | KEY_MOD_CAPS, KEY_ACTION_CLEAR);
+    expect_action("C-Return", XKB_KEY_Return, KEY_MOD_CTRL, KEY_ACTION_SUBMIT);
+}
+
+static void expect_compose(const char *what, xkb_keysym_t ksym, bool expected) {
+    if (keys_starts_compose(ksym) == expected)
+        return;
+    fprintf(stderr, "FAIL: %s: expected %s\n", what, (expected ? "compose" : "no compose"));
+    failures++;
+}
+
+static void test_compose(void) {
+    expect_compose("Multi_key", XKB_KEY_Multi_key, true);
+    expect_compose("dead_grave", XKB_KEY_dead_grave, true);
+    expect_compose("dead_greek", XKB_KEY_dead_greek, true);
+    /* The dead keys after dead_greek, e.g. dead_lowline (0xfe90). */
+    expect_compose("dead_lowline", 0xfe90, true);
+    expect_compose("dead_longsolidusoverlay", XKB_KEY_dead_longsolidusoverlay, true);
+    expect_compose("after the dead keys", XKB_KEY_dead_longsolidusoverlay + 1, false);
+    expect_compose("j", XKB_KEY_j, false);
+    expect_compose("Return", XKB_KEY_Return, false);
+}
+
+static void test_modifiers(void) {
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_DEFAULT_INCLUDES);
+    if (context == NULL) {
+        fprintf(stderr, "FAIL: could not create the xkb context\n");
+        failures++;
+        return;
+    }
+    struct xkb_keymap *keymap = xkb_keymap_new_from_string(context, keymap_string,
+                                                           XKB_KEYMAP_FORMAT_TEXT_V1,
+                                                           XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (keymap == NULL) {
+        fprintf(stderr, "FAIL: could not compile the test keymap\n");
+        failures++;
+        xkb_context_unref(context);
+        return;
+    }
+    keys_set_keymap(keymap);
+    struct xkb_state *state = xkb_state_new(keymap);
+
+    expect_modifiers("no modifiers", state, 0);
+
+    xkb_state_update_key(state, KEYCODE_LCTL, XKB_KEY_DOWN);
+    expect_modifiers("Control held", state, KEY_MOD_CTRL);
+    xkb_state_update_key(state, KEYCODE_LCTL, XKB_KEY_UP);
+    expect_modifiers("Control released", state, 0);
+
+    xkb_state_update_key(state, KEYCODE_CAPS, XKB_KEY_DOWN);
+    xkb_state_update_key(state, KEYCODE_CAPS, XKB_KEY_UP);
+    expect_modifiers("Caps Lock on", state, KEY_MOD_CAPS);
+
+    xkb_state_update_key(state, KEYCODE_LCTL, XKB_KEY_DOWN);
+    expect_modifiers("Caps Lock on, Control held", state, KEY_MOD_CTRL | KEY_MOD_CAPS);
+    xkb_state_update_key(state, KEYCODE_LCTL, XKB_KEY_UP);
+
+    xkb_state_update_key(state, KEYCODE_CAPS, XKB_KEY_DOWN);
+    xkb_state_update_key(state, KEYCODE_CAPS, XKB_KEY_UP);
+    expect_modifiers("Caps Lock off", state, 0);
+
+    xkb_state_unref(state);
+    xkb_keymap_unref(keymap);
+    xkb_context_unref(context);
+}
+
+int main(void) {
+    test_classify();
+    test_compose();
+    test_modifiers();
+
+    if (failures > 0) {
+        fprintf(stderr, "keys_test: %d failure(s)\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("keys_test: all tests passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * notify.c: tells whoever started i3lock that the screen is locked, i.e. that
+ *           the window is mapped (with the first frame) and pointer and
+ *           keyboard are grabbed, so that e.g. a suspend can proceed as soon
+ *           as (and only when) the lock is actually in place:
+ *
+ *           - on the file descriptor given with --ready-fd, a message in the
+ *             style of sd_notify(3) is written, which includes how long the
+ *             startup phases took (see timing.c), and the fd is closed.
+ *
+ *           - the sleep lock fd passed by xss-lock (XSS_SLEEP_LOCK_FD) is
+ *             closed, which lets logind go ahead with the suspend.
+ *
+ *           Both only happen once. SIGPIPE is ignored (see main()), so if
+ *           the reader is gone, writing just fails. Every process holding a
+ *           copy of the fds has to close it before the other end notices, so
+ *           processes which do not lock the screen themselves drop theirs,
+ *           see notify_release().
+ *
+ *           With --displays, the sessions write their message to a pipe to
+ *           the supervisor instead (see notify_delegate()), which notifies
+ *           once, when all displays are locked, see supervisor.c.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "i3lock.h"
+#include "notify.h"
+#include "timing.h"
+
+extern bool debug_mode;
+
+/* The fd given with --ready-fd, -1 if none (or already notified). */
+static int ready_fd = -1;
+/* The fd from XSS_SLEEP_LOCK_FD, -1 if none (or already closed). */
+static int sleep_lock_fd = -1;
+
+/*
+ * Takes over the given fd (-1 for none) and the sleep lock fd of xss-lock,
+ * if any. Neither is passed on to processes we start.
+ *
+ */
+void notify_init(int fd) {
+    ready_fd = fd;
+    if (ready_fd != -1)
+        fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+
+    const char *value = getenv("XSS_SLEEP_LOCK_FD");
+    char *endptr;
+    if (value != NULL && *value != '\0') {
+        long int parsed = strtol(value, &endptr, 10);
+        if (*endptr == '\0' && parsed >= 0 && fcntl(parsed, F_GETFD) != -1) {
+            sleep_lock_fd = parsed;
+            fcntl(sleep_lock_fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    /* Only we hold the sleep lock fd now. */
+    unsetenv("XSS_SLEEP_LOCK_FD");
+}
+
+/*
+ * Closes our copies without notifying, in processes which do not lock the
+ * screen themselves (the parent waiting for the forked i3lock, or the
+ * supervisor of --displays, whose sessions each notify once locked).
+ *
+ */
+void notify_release(void) {
+    if (ready_fd != -1)
+        close(ready_fd);
+    if (sleep_lock_fd != -1)
+        close(sleep_lock_fd);
+    ready_fd = -1;
+    sleep_lock_fd = -1;
+}
+
+/*
+ * In a session of --displays: drops our copies of the fds and notifies
+ * through the given fd (a pipe to the supervisor) instead.
+ *
+ */
+void notify_delegate(int fd) {
+    notify_release();
+    ready_fd = fd;
+    fcntl(ready_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Whether anybody waits to be notified.
+ *
+ */
+bool notify_wanted(void) {
+    return ready_fd != -1 || sleep_lock_fd != -1;
+}
+
+/*
+ * Notifies that the screen is locked, see the top of this file. Does nothing
+ * after the first call.
+ *
+ */
+void notify_locked(void) {
+    char phases[256];
+    phase_summary(phases, sizeof(phases));
+    notify_locked_phases(phases);
+}
+
+/*
+ * Like notify_locked(), with the given phase timings (see phase_summary()),
+ * e.g. those of a session, see supervisor.c.
+ *
+ */
+void notify_locked_phases(const char *phases) {
+    if (ready_fd != -1) {
+        char message[384];
+        int len = snprintf(message, sizeof(message),
+                           "READY=1\nSTATUS=Locked\nMAINPID=%d\nX_I3LOCK_PHASES=%s\n",
+                           (int)getpid(), phases);
+        if (len >= (int)sizeof(message))
+            len = sizeof(message) - 1;
+
+        const char *pos = message;
+        while (len > 0) {
+            ssize_t n = write(ready_fd, pos, len);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EPIPE) {
+                DEBUG("nobody is listening on the ready fd\n");
+                break;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "[i3lock] Could not write to the ready fd: %s\n", strerror(errno));
+                break;
+            }
+            pos += n;
+            len -= n;
+        }
+        close(ready_fd);
+        ready_fd = -1;
+        DEBUG("notified readiness: %s\n", phases);
+    }
+
+    if (sleep_lock_fd != -1) {
+        close(sleep_lock_fd);
+        sleep_lock_fd = -1;
+        DEBUG("released the sleep lock of xss-lock\n");
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef _NOTIFY_H
+#define _NOTIFY_H
+
+#include <stdbool.h>
+
+void notify_init(int ready_fd);
+void notify_release(void);
+void notify_delegate(int fd);
+bool notify_wanted(void);
+void notify_locked(void);
+void notify_locked_phases(const char *phases);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * render.c: the render thread. It draws everything (see unlock_indicator.c)
+ *           on its own X11 connection, so that a slow frame (a large image,
+ *           many screens) neither delays reading the next key press nor
+ *           holds up requests of the main thread on the socket.
+ *
+ *           The main thread posts commands (e.g. a redraw with a snapshot of
+ *           the state to show) to a single-producer/single-consumer queue,
+ *           which needs no lock: each side only ever writes its own index. A
+ *           semaphore wakes the thread up. All commands which arrived while a
+ *           frame was drawn are applied at once, and only the latest state is
+ *           drawn.
+ *
+ *           If the queue is full (the thread is stuck in a slow frame), the
+ *           main thread does not wait: commands are kept in an overflow list,
+ *           where redraws and lines of text are coalesced with the newer
+ *           ones, and moved to the queue once the thread made room (see
+ *           render_watch()). Commands which hand over memory are never
+ *           dropped.
+ *
+ *           Until the thread runs (and if it cannot be started), commands are
+ *           executed right away on the calling thread.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <xcb/xcb.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "harden.h"
+#include "render.h"
+
+/* Needs to be a power of two, see queue_push(). */
+#define QUEUE_SIZE 64
+
+extern bool debug_mode;
+
+static render_msg_t queue[QUEUE_SIZE];
+/* The next message to read, only written by the render thread. */
+static unsigned int queue_head;
+/* The next message to write, only written by the main thread. */
+static unsigned int queue_tail;
+/* Counts the posted messages, the render thread sleeps on it. */
+static sem_t queue_posted;
+
+/* Whether the thread runs. Only used by the main thread. */
+static bool running = false;
+static xcb_connection_t *render_conn;
+/* Set by render_start(), see render_thread(). */
+static bool render_raise_priority;
+static bool render_prefault_stack;
+
+/* Commands which did not fit into the queue, in order. Only used by the main
+ * thread. */
+static render_msg_t *overflow;
+static int overflow_len;
+static int overflow_size;
+/* Set while there is an overflow, so that the render thread wakes up the
+ * main thread once it made room. */
+static bool overflowing = false;
+static struct ev_loop *space_loop;
+static struct ev_async *space_watcher;
+
+/*
+ * Appends a copy of the message. Returns false if the queue is full. Only
+ * called by the main thread.
+ *
+ */
+static bool queue_push(const render_msg_t *msg) {
+    const unsigned int tail = queue_tail;
+    if (tail - __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+        return false;
+
+    queue[tail % QUEUE_SIZE] = *msg;
+    /* Publishes the message along with the index. */
+    __atomic_store_n(&queue_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Takes the oldest message. Returns false if the queue is empty. Only called
+ * by the render thread.
+ *
+ */
+static bool queue_pop(render_msg_t *msg) {
+    const unsigned int head = queue_head;
+    if (head == __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    *msg = queue[head % QUEUE_SIZE];
+    /* Hands the slot back to the main thread. */
+    __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Reads the events on the render connection. Nothing is selected on it, so
+ * these are only errors.
+ *
+ */
+static void discard_events(void) {
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(render_conn)) != NULL) {
+        if (event->response_type == 0)
+            DEBUG("render thread: X11 error %d\n", ((xcb_generic_error_t *)event)->error_code);
+        free(event);
+    }
+}
+
+static void *render_thread(void *arg) {
+    /* Key presses end up here, so with --raise-priority and --hardened, this
+     * thread needs the same treatment as the main thread. Its stack is
+     * faulted in before the memory is locked. */
+    if (render_raise_priority)
+        harden_raise_priority();
+    if (render_prefault_stack)
+        harden_prefault_stack();
+
+    render_attach(render_conn);
+
+    for (;;) {
+        if (sem_wait(&queue_posted) != 0)
+            continue;
+
+        render_msg_t msg;
+        bool any = false;
+        while (queue_pop(&msg)) {
+            render_execute(&msg);
+            any = true;
+        }
+        /* The semaphore is also posted for messages which were already
+         * handled in the previous round. */
+        if (!any)
+            continue;
+
+        /* There is room in the queue now. The fence orders the stores to
+         * queue_head (release only) before the load of the flag, see
+         * drain_overflow(). */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&overflowing, __ATOMIC_SEQ_CST))
+            ev_async_send(space_loop, space_watcher);
+
+        render_flush();
+        discard_events();
+    }
+    return NULL;
+}
+
+/*
+ * Opens the render connection and starts the thread, which takes over
+ * drawing from now on. With raise_priority and prefault_stack, the thread
+ * raises its priority and faults in its stack (see harden.c). Returns false
+ * (and keeps drawing on the main thread) if that is not possible.
+ *
+ */
+bool render_start(bool raise_priority, bool prefault_stack) {
+    render_raise_priority = raise_priority;
+    render_prefault_stack = prefault_stack;
+
+    render_conn = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(render_conn)) {
+        fprintf(stderr, "[i3lock] Could not open a second X11 connection, drawing on the main thread\n");
+        xcb_disconnect(render_conn);
+        render_conn = NULL;
+        return false;
+    }
+
+    if (sem_init(&queue_posted, 0, 0) != 0) {
+        fprintf(stderr, "[i3lock] sem_init: %s, drawing on the main thread\n", strerror(errno));
+        xcb_disconnect(render_conn);
+        render_conn = NULL;
+        return false;
+    }
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, render_thread, NULL);
+    if (error != 0) {
+        fprintf(stderr, "[i3lock] Could not start the render thread: %s, drawing on the main thread\n",
+                strerror(error));
+        sem_destroy(&queue_posted);
+        xcb_disconnect(render_conn);
+        render_conn = NULL;
+        return false;
+    }
+    pthread_detach(thread);
+    running = true;
+    DEBUG("render thread started\n");
+    return true;
+}
+
+/*
+ * Moves as many commands from the overflow list to the queue as fit.
+ *
+ */
+static void drain_overflow(void) {
+    /* Set before trying, so that the render thread, which makes room before
+     * checking the flag, cannot miss that we are waiting for it. Either it
+     * sees the flag, or we see the room it made: the fence (like the one in
+     * render_thread()) keeps the store from being ordered after the loads of
+     * queue_head in queue_push(). */
+    __atomic_store_n(&overflowing, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int moved = 0;
+    while (moved < overflow_len && queue_push(&overflow[moved])) {
+        sem_post(&queue_posted);
+        moved++;
+    }
+    memmove(overflow, overflow + moved, (overflow_len - moved) * sizeof(render_msg_t));
+    overflow_len -= moved;
+
+    if (overflow_len == 0)
+        __atomic_store_n(&overflowing, false, __ATOMIC_SEQ_CST);
+    else
+        DEBUG("render queue full, %d command(s) waiting\n", overflow_len);
+}
+
+/*
+ * Replaces a command in the overflow list which the given one supersedes.
+ * Redraws and lines of text are only snapshots, of which the render thread
+ * uses the latest one anyway. Returns false if there is none.
+ *
+ */
+static bool coalesce(const render_msg_t *msg) {
+    for (int i = overflow_len - 1; i >= 0; i--) {
+        render_msg_t *pending = &overflow[i];
+        if (pending->command != msg->command)
+            continue;
+        if (msg->command == RENDER_REDRAW_SCREEN ||
+            msg->command == RENDER_REDRAW_TEXT ||
+            (msg->command == RENDER_SET_TEXT && pending->u.text.line == msg->u.text.line)) {
+            *pending = *msg;
+            return true;
+        }
+    }
+
+    /* Consecutive frames of an animation each replace the whole background,
+     * so only the latest one needs to be painted. The older one was not
+     * handed over yet, so we release its reference. */
+    if (msg->command == RENDER_UPDATE_BACKGROUND && overflow_len > 0 &&
+        overflow[overflow_len - 1].command == RENDER_UPDATE_BACKGROUND) {
+        cairo_surface_destroy(overflow[overflow_len - 1].u.image.image);
+        overflow[overflow_len - 1] = *msg;
+        return true;
+    }
+    return false;
+}
+
+static void space_cb(EV_P_ ev_async *w, int revents) {
+    drain_overflow();
+}
+
+/*
+ * Lets the render thread wake up the given event loop when it made room in
+ * the queue, which is needed to keep posting without waiting for it.
+ *
+ */
+void render_watch(struct ev_loop *loop) {
+    if (!running)
+        return;
+
+    space_watcher = calloc(sizeof(struct ev_async), 1);
+    if (space_watcher == NULL)
+        return;
+    ev_async_init(space_watcher, space_cb);
+    ev_async_start(loop, space_watcher);
+    space_loop = loop;
+}
+
+/*
+ * Posts the given command to the render thread, or executes it right away if
+ * there is none. Never waits for the render thread once render_watch() was
+ * called.
+ *
+ */
+void render_post(const render_msg_t *msg) {
+    if (!running) {
+        render_execute(msg);
+        render_flush();
+        return;
+    }
+
+    /* Commands are applied in order, so nothing can overtake the overflow. */
+    if (overflow_len == 0 && queue_push(msg)) {
+        sem_post(&queue_posted);
+        return;
+    }
+
+    if (space_watcher == NULL) {
+        /* Nobody would move the overflow to the queue, so we wait. */
+        while (!queue_push(msg))
+            sched_yield();
+        sem_post(&queue_posted);
+        return;
+    }
+
+    if (!coalesce(msg)) {
+        if (overflow_len == overflow_size) {
+            int size = (overflow_size == 0 ? QUEUE_SIZE : overflow_size * 2);
+            render_msg_t *grown = realloc(overflow, size * sizeof(render_msg_t));
+            if (grown == NULL)
+                err(EXIT_FAILURE, "realloc");
+            overflow = grown;
+            overflow_size = size;
+        }
+        overflow[overflow_len++] = *msg;
+    }
+    drain_overflow();
+}
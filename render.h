@@ -0,0 +1,84 @@
+#ifndef _RENDER_H
+#define _RENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
+#include <ev.h>
+
+#include "unlock_indicator.h"
+#include "xinerama.h"
+#include "text.h"
+#include "theme.h"
+
+/* Longest line of text which can be posted, see RENDER_SET_TEXT. */
+#define RENDER_TEXT_MAX 128
+
+/* What the unlock indicator shows, copied for every redraw. */
+typedef struct {
+    unlock_state_t unlock_state;
+    pam_state_t pam_state;
+    int input_position;
+    bool caps_lock;
+} render_state_t;
+
+typedef enum {
+    RENDER_REDRAW_SCREEN = 0, /* state */
+    RENDER_REDRAW_TEXT,       /* (nothing) */
+    RENDER_SET_TEXT,          /* text */
+    RENDER_SET_SCREENS,       /* screens */
+    RENDER_SET_THEME,         /* theme */
+    RENDER_INVALIDATE_BACKGROUND,
+    RENDER_INVALIDATE_FRAME,
+    RENDER_PREPARE_BACKGROUND, /* image */
+    RENDER_SWITCH_BACKGROUND,
+    RENDER_UPDATE_BACKGROUND, /* image */
+    RENDER_SET_SOURCE         /* source */
+} render_command_t;
+
+typedef struct {
+    render_command_t command;
+    union {
+        render_state_t state;
+        struct {
+            text_line_t line;
+            char text[RENDER_TEXT_MAX];
+        } text;
+        /* The areas are handed over and freed by the receiver. */
+        struct {
+            uint32_t resolution[2];
+            Rect *areas;
+            int num_areas;
+        } screens;
+        /* The theme is handed over, the previous one is freed. */
+        struct {
+            theme_t *theme;
+            unsigned int changes;
+        } theme;
+        /* The receiver holds a reference to the image. */
+        struct {
+            cairo_surface_t *image;
+            double scale;
+        } image;
+        /* The same, and the pixmap (if any) is handed over. */
+        struct {
+            cairo_surface_t *image;
+            double scale;
+            xcb_pixmap_t pixmap;
+            uint32_t resolution[2];
+        } source;
+    } u;
+} render_msg_t;
+
+bool render_start(bool raise_priority, bool prefault_stack);
+void render_watch(struct ev_loop *loop);
+void render_post(const render_msg_t *msg);
+
+/* Implemented in unlock_indicator.c, called on the render thread (or on the
+ * main thread if there is none). */
+void render_attach(xcb_connection_t *conn);
+void render_execute(const render_msg_t *msg);
+void render_flush(void);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * supervisor.c: with --displays, one i3lock locks several X displays (e.g.
+ *               the sessions of a terminal server). Everything which does
+ *               not depend on the display (the decoded image, the compose
+ *               table, compiled keymaps) is loaded once before forking one
+ *               session per display, so the sessions share these pages
+ *               (copy-on-write) and memory grows with the number of distinct
+ *               assets rather than the number of displays. Each session has
+ *               its own X11 connection and authentication helper.
+ *
+ *               The sessions report to the supervisor once their display is
+ *               locked (through a pipe each, see notify_delegate()), and only
+ *               the supervisor notifies whoever started i3lock (see
+ *               notify.c), once all displays are locked.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <ev.h>
+
+#include "i3lock.h"
+#include "notify.h"
+#include "supervisor.h"
+
+extern bool debug_mode;
+
+/* Large enough for the message of notify_locked(). */
+#define REPORT_SIZE 512
+
+typedef struct {
+    const char *display;
+    pid_t pid;
+    struct ev_child watcher;
+    /* The pipe on which the session reports that it is locked, -1 if not
+     * needed (nobody waits to be notified). */
+    int report_fd;
+    struct ev_io report_watcher;
+    char report[REPORT_SIZE];
+    size_t report_len;
+    bool locked;
+} session_t;
+
+static session_t *sessions;
+static int num_sessions;
+static int running;
+static int num_locked;
+static bool any_failed;
+
+static void child_cb(EV_P_ ev_child *w, int revents) {
+    session_t *session = w->data;
+    ev_child_stop(EV_A_ w);
+    running--;
+
+    if (WIFEXITED(w->rstatus) && WEXITSTATUS(w->rstatus) == 0) {
+        DEBUG("session on %s unlocked\n", session->display);
+    } else {
+        any_failed = true;
+        if (WIFSIGNALED(w->rstatus))
+            fprintf(stderr, "[i3lock] session on %s was killed by signal %d\n",
+                    session->display, WTERMSIG(w->rstatus));
+        else
+            fprintf(stderr, "[i3lock] session on %s exited with status %d\n",
+                    session->display, WEXITSTATUS(w->rstatus));
+    }
+
+    if (running == 0)
+        ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Reads the report of a session (the message of notify_locked()). Once every
+ * session reported, notifies with the phase timings of the last one, i.e. of
+ * the display which took longest to lock.
+ *
+ */
+static void report_cb(EV_P_ ev_io *w, int revents) {
+    session_t *session = w->data;
+    ssize_t n = read(session->report_fd, session->report + session->report_len,
+                     sizeof(session->report) - 1 - session->report_len);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n > 0) {
+        session->report_len += n;
+        session->report[session->report_len] = '\0';
+    }
+
+    /* The phases are the last line of the message. */
+    const char *phases = strstr(session->report, "X_I3LOCK_PHASES=");
+    const bool complete = (phases != NULL && strchr(phases, '\n') != NULL);
+    if (!complete && n > 0 && session->report_len < sizeof(session->report) - 1)
+        return;
+
+    ev_io_stop(EV_A_ w);
+    close(session->report_fd);
+    session->report_fd = -1;
+    if (!complete)
+        return;
+
+    session->locked = true;
+    DEBUG("session on %s is locked\n", session->display);
+    if (++num_locked < num_sessions)
+        return;
+
+    char timings[256];
+    phases += strlen("X_I3LOCK_PHASES=");
+    snprintf(timings, sizeof(timings), "%.*s", (int)(strchr(phases, '\n') - phases), phases);
+    notify_locked_phases(timings);
+}
+
+/*
+ * Passes SIGHUP (reload the theme) and SIGUSR1 (lock, with --daemon) on to
+ * all sessions, and SIGTERM/SIGINT so that no session outlives us.
+ *
+ */
+static void forward_signal_cb(EV_P_ ev_signal *w, int revents) {
+    for (int i = 0; i < num_sessions; i++)
+        if (ev_is_active(&(sessions[i].watcher)))
+            kill(sessions[i].pid, w->signum);
+    if (w->signum == SIGTERM || w->signum == SIGINT)
+        ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Forks one session per display. Returns the display in the session
+ * processes, which continue locking it. The supervisor process waits for all
+ * sessions and exits with 0 once all of them unlocked, 1 if any failed.
+ *
+ */
+const char *supervisor_run(char **displays, int num_displays) {
+    sessions = calloc(sizeof(session_t), num_displays);
+    if (sessions == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    /* Needs to exist before forking, so that no SIGCHLD is missed. */
+    struct ev_loop *loop = EV_DEFAULT;
+    if (loop == NULL)
+        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
+
+    const bool report = notify_wanted();
+    for (int i = 0; i < num_displays; i++) {
+        int fds[2] = {-1, -1};
+        if (report && pipe(fds) == -1)
+            err(EXIT_FAILURE, "pipe");
+
+        pid_t pid = fork();
+        if (pid == -1)
+            err(EXIT_FAILURE, "fork");
+        if (pid == 0) {
+            /* The session continues with a copy of the loop, which must
+             * not wait for its siblings. */
+            ev_loop_fork(loop);
+            for (int j = 0; j < num_sessions; j++) {
+                ev_child_stop(loop, &(sessions[j].watcher));
+                if (sessions[j].report_fd != -1) {
+                    ev_io_stop(loop, &(sessions[j].report_watcher));
+                    close(sessions[j].report_fd);
+                }
+            }
+            if (report) {
+                close(fds[0]);
+                notify_delegate(fds[1]);
+            }
+            setenv("DISPLAY", displays[i], 1);
+            return displays[i];
+        }
+
+        session_t *session = &sessions[num_sessions++];
+        session->display = displays[i];
+        session->pid = pid;
+        session->watcher.data = session;
+        ev_child_init(&(session->watcher), child_cb, pid, 0);
+        ev_child_start(loop, &(session->watcher));
+        session->report_fd = fds[0];
+        if (report) {
+            close(fds[1]);
+            fcntl(session->report_fd, F_SETFD, FD_CLOEXEC);
+            session->report_watcher.data = session;
+            ev_io_init(&(session->report_watcher), report_cb, session->report_fd, EV_READ);
+            ev_io_start(loop, &(session->report_watcher));
+        }
+        running++;
+        DEBUG("session on %s has pid %d\n", displays[i], (int)pid);
+    }
+
+    static const int forwarded[] = {SIGHUP, SIGUSR1, SIGTERM, SIGINT};
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        struct ev_signal *watcher = calloc(sizeof(struct ev_signal), 1);
+        ev_signal_init(watcher, forward_signal_cb, forwarded[i]);
+        ev_signal_start(loop, watcher);
+    }
+
+    ev_run(loop, 0);
+    exit(any_failed || running > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
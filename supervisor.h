@@ -0,0 +1,6 @@
+#ifndef _SUPERVISOR_H
+#define _SUPERVISOR_H
+
+const char *supervisor_run(char **displays, int num_displays);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * text.c: the lines of text around the unlock indicator (clock, failed
+ *         attempts, keyboard layout, message). Each line is shaped into
+ *         glyphs once when its content changes, using scaled fonts which are
+ *         created once. Lines remember what is on the screen, so that only
+ *         the lines which changed need to be re-rendered, see
+ *         redraw_text().
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "text.h"
+#include "theme.h"
+
+#define FONT_FAMILY "sans-serif"
+#define FONT_SIZE 14
+#define FONT_SIZE_LARGE 32
+/* Distance between the unlock indicator and the text, in pixels at 96 DPI. */
+#define INDICATOR_GAP 8
+
+extern bool debug_mode;
+
+typedef struct {
+    /* The current content, NULL if the line is hidden. */
+    char *text;
+    /* The shaped text (relative to the start of the baseline), valid if
+     * shaped is true. */
+    cairo_glyph_t *glyphs;
+    int num_glyphs;
+    double width;
+    bool shaped;
+    /* The width of what is on the screen right now. */
+    double drawn_width;
+    bool dirty;
+} line_state_t;
+
+static line_state_t lines[TEXT_COUNT];
+
+/* The fonts for the current scale, the large one is used for the time. */
+static cairo_scaled_font_t *font_normal;
+static cairo_scaled_font_t *font_large;
+static cairo_font_extents_t extents_normal;
+static cairo_font_extents_t extents_large;
+static double font_scale;
+
+static cairo_scaled_font_t *create_font(double size) {
+    cairo_font_face_t *face = cairo_toy_font_face_create(FONT_FAMILY, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_font_options_t *options = cairo_font_options_create();
+    cairo_matrix_t font_matrix, ctm;
+
+    cairo_matrix_init_scale(&font_matrix, size, size);
+    cairo_matrix_init_identity(&ctm);
+    cairo_scaled_font_t *font = cairo_scaled_font_create(face, &font_matrix, &ctm, options);
+
+    cairo_font_options_destroy(options);
+    cairo_font_face_destroy(face);
+    return font;
+}
+
+/*
+ * Creates the fonts for the given scale, unless they exist already. When the
+ * scale changes, all lines need to be shaped again.
+ *
+ */
+static void ensure_fonts(double scale) {
+    if (font_normal != NULL && font_scale == scale)
+        return;
+
+    if (font_normal != NULL) {
+        cairo_scaled_font_destroy(font_normal);
+        cairo_scaled_font_destroy(font_large);
+    }
+
+    font_normal = create_font(FONT_SIZE * scale);
+    font_large = create_font(FONT_SIZE_LARGE * scale);
+    cairo_scaled_font_extents(font_normal, &extents_normal);
+    cairo_scaled_font_extents(font_large, &extents_large);
+    font_scale = scale;
+    DEBUG("created fonts for scale %.2f\n", scale);
+
+    for (int i = 0; i < TEXT_COUNT; i++)
+        lines[i].shaped = false;
+}
+
+static cairo_scaled_font_t *line_font(text_line_t line) {
+    return (line == TEXT_TIME ? font_large : font_normal);
+}
+
+static const cairo_font_extents_t *line_extents(text_line_t line) {
+    return (line == TEXT_TIME ? &extents_large : &extents_normal);
+}
+
+static void shape(text_line_t line) {
+    line_state_t *state = &lines[line];
+    if (state->shaped)
+        return;
+
+    cairo_glyph_free(state->glyphs);
+    state->glyphs = NULL;
+    state->num_glyphs = 0;
+    state->width = 0;
+
+    if (state->text != NULL &&
+        cairo_scaled_font_text_to_glyphs(line_font(line), 0, 0, state->text, -1,
+                                         &(state->glyphs), &(state->num_glyphs),
+                                         NULL, NULL, NULL) == CAIRO_STATUS_SUCCESS) {
+        cairo_text_extents_t extents;
+        cairo_scaled_font_glyph_extents(line_font(line), state->glyphs, state->num_glyphs, &extents);
+        state->width = extents.x_advance;
+    }
+    state->shaped = true;
+}
+
+/*
+ * Sets the content of the given line, NULL (or an empty string) hides it.
+ * Nothing is drawn until the next redraw_screen() or redraw_text().
+ *
+ */
+void text_set(text_line_t line, const char *text) {
+    line_state_t *state = &lines[line];
+
+    if (text != NULL && *text == '\0')
+        text = NULL;
+    if (text == NULL && state->text == NULL)
+        return;
+    if (text != NULL && state->text != NULL && strcmp(text, state->text) == 0)
+        return;
+
+    free(state->text);
+    state->text = (text != NULL ? strdup(text) : NULL);
+    state->shaped = false;
+    state->dirty = true;
+}
+
+/*
+ * Returns whether any line changed since it was last drawn.
+ *
+ */
+bool text_dirty(void) {
+    for (int i = 0; i < TEXT_COUNT; i++)
+        if (lines[i].dirty)
+            return true;
+    return false;
+}
+
+/*
+ * Returns the baseline of the given line for the given area (a screen), in
+ * which the unlock indicator is centered.
+ *
+ */
+static double baseline(text_line_t line, const Rect *area, int indicator_diameter, double scale) {
+    double center = area->y + area->height / 2;
+    double top = center - indicator_diameter / 2 - INDICATOR_GAP * scale;
+    double bottom = center + indicator_diameter / 2 + INDICATOR_GAP * scale;
+
+    switch (line) {
+        case TEXT_TIME:
+            return top - extents_normal.height - extents_large.descent;
+        case TEXT_DATE:
+            return top - extents_normal.descent;
+        default:
+            return bottom + extents_normal.ascent + (line - TEXT_MESSAGE) * extents_normal.height;
+    }
+}
+
+/*
+ * Stores the rectangle covered by the given line (if it is width pixels wide)
+ * in rect.
+ *
+ */
+static void line_rect(text_line_t line, const Rect *area, int indicator_diameter, double scale, double width, Rect *rect) {
+    const cairo_font_extents_t *extents = line_extents(line);
+    double y = baseline(line, area, indicator_diameter, scale);
+    double x = area->x + (area->width - width) / 2;
+
+    rect->x = floor(x) - 1;
+    rect->y = floor(y - extents->ascent) - 1;
+    rect->width = ceil(width) + 2;
+    rect->height = ceil(extents->ascent + extents->descent) + 2;
+}
+
+/*
+ * Stores the rectangles which need to be re-rendered in the given area (the
+ * old and the new extent of each changed line) in rects, which must have room
+ * for TEXT_COUNT entries. Returns the number of rectangles.
+ *
+ */
+int text_damage(const Rect *area, int indicator_diameter, double scale, Rect *rects) {
+    int n = 0;
+
+    ensure_fonts(scale);
+    for (int i = 0; i < TEXT_COUNT; i++) {
+        if (!lines[i].dirty)
+            continue;
+        shape(i);
+        double width = (lines[i].width > lines[i].drawn_width ? lines[i].width : lines[i].drawn_width);
+        if (width > 0)
+            line_rect(i, area, indicator_diameter, scale, width, &rects[n++]);
+    }
+    return n;
+}
+
+/*
+ * Draws all lines in the given area (a screen). The caller clips the context
+ * if only the damaged parts should be re-rendered.
+ *
+ */
+void text_draw(cairo_t *ctx, const Rect *area, int indicator_diameter, double scale) {
+    ensure_fonts(scale);
+    cairo_save(ctx);
+    theme_set_source(ctx, &theme->icon);
+
+    for (int i = 0; i < TEXT_COUNT; i++) {
+        shape(i);
+        if (lines[i].num_glyphs == 0)
+            continue;
+
+        cairo_save(ctx);
+        cairo_translate(ctx,
+                        area->x + (area->width - lines[i].width) / 2,
+                        baseline(i, area, indicator_diameter, scale));
+        cairo_set_scaled_font(ctx, line_font(i));
+        cairo_show_glyphs(ctx, lines[i].glyphs, lines[i].num_glyphs);
+        cairo_restore(ctx);
+    }
+
+    cairo_restore(ctx);
+}
+
+/*
+ * Records that all lines are on the screen as they are now. Called after
+ * drawing them on all screens.
+ *
+ */
+void text_mark_clean(void) {
+    for (int i = 0; i < TEXT_COUNT; i++) {
+        lines[i].drawn_width = (lines[i].text != NULL ? lines[i].width : 0);
+        lines[i].dirty = false;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef _TEXT_H
+#define _TEXT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cairo.h>
+
+#include "xinerama.h"
+
+/* The lines of text, in the order in which they are placed: the time and the
+ * date above the unlock indicator, the others below it. */
+typedef enum {
+    TEXT_TIME = 0,
+    TEXT_DATE,
+    TEXT_MESSAGE,
+    TEXT_KEYBOARD,
+    TEXT_FAILED,
+    TEXT_COUNT
+} text_line_t;
+
+void text_set(text_line_t line, const char *text);
+bool text_dirty(void);
+int text_damage(const Rect *area, int indicator_diameter, double scale, Rect *rects);
+void text_draw(cairo_t *ctx, const Rect *area, int indicator_diameter, double scale);
+void text_mark_clean(void);
+
+#endif
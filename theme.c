@@ -0,0 +1,274 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * theme.c: compiles the theme (colors and layout) from the defaults, the
+ *          theme file (--theme) and the command line options, in that
+ *          order. Colors are converted once, when compiling, instead of
+ *          being parsed from hex strings on every redraw. On SIGHUP, the
+ *          theme file is read again and the new theme is compared to the
+ *          old one, so that only what changed needs to be rendered again.
+ *
+ *          The theme file contains one “key = value” per line, using the
+ *          names of the long options (e.g. “color-icon = ffffff”). Lines
+ *          starting with # are ignored.
+ *
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "theme.h"
+
+extern bool debug_mode;
+
+const theme_t *theme;
+
+typedef enum {
+    OPTION_COLOR,
+    OPTION_SCALE
+} option_type_t;
+
+static const struct {
+    const char *name;
+    option_type_t type;
+    size_t offset;
+} options[] = {
+    {"color", OPTION_COLOR, offsetof(theme_t, background)},
+    {"color-icon", OPTION_COLOR, offsetof(theme_t, icon)},
+    {"color-verify", OPTION_COLOR, offsetof(theme_t, verify)},
+    {"color-wrong", OPTION_COLOR, offsetof(theme_t, wrong)},
+    {"color-bg", OPTION_COLOR, offsetof(theme_t, indicator)},
+    {"color-border", OPTION_COLOR, offsetof(theme_t, border)},
+    {"color-timeout", OPTION_COLOR, offsetof(theme_t, timeout)},
+    {"icon_scale", OPTION_SCALE, offsetof(theme_t, icon_scale)},
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+/* The values given on the command line, which take precedence over the
+ * theme file. NULL if not given. */
+static char *overrides[NUM_OPTIONS];
+
+static char *theme_path;
+
+static const char *defaults[NUM_OPTIONS] = {
+    "000000", /* color */
+    "ffffff", /* color-icon */
+    "0000ff", /* color-verify */
+    "ff0000", /* color-wrong */
+    "000000", /* color-bg */
+    "ffffff", /* color-border */
+    "ffa500", /* color-timeout */
+    "4.0",    /* icon_scale */
+};
+
+static int find_option(const char *key) {
+    for (size_t i = 0; i < NUM_OPTIONS; i++)
+        if (strcmp(options[i].name, key) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * Parses a color in 3-byte hexadecimal format (rrggbb, optionally prefixed
+ * with #).
+ *
+ */
+static bool parse_color(const char *hex, color_t *color) {
+    char digits[7];
+
+    /* Skip # if present */
+    if (hex[0] == '#')
+        hex++;
+
+    if (strlen(hex) != 6 || sscanf(hex, "%06[0-9a-fA-F]", digits) != 1)
+        return false;
+
+    color->pixel = strtoul(digits, NULL, 16);
+    color->red = ((color->pixel >> 16) & 0xFF) / 255.0;
+    color->green = ((color->pixel >> 8) & 0xFF) / 255.0;
+    color->blue = (color->pixel & 0xFF) / 255.0;
+    return true;
+}
+
+/*
+ * Stores the given value of the option with the given index in the theme.
+ * Prints an error and returns false if the value is invalid.
+ *
+ */
+static bool apply_option(theme_t *new_theme, int index, const char *value) {
+    void *field = (char *)new_theme + options[index].offset;
+
+    switch (options[index].type) {
+        case OPTION_COLOR:
+            if (!parse_color(value, field)) {
+                fprintf(stderr, "[i3lock] %s is invalid, it must be given in 3-byte hexadecimal format: rrggbb\n",
+                        options[index].name);
+                return false;
+            }
+            break;
+        case OPTION_SCALE:
+            if (sscanf(value, "%lf", (double *)field) != 1 || *(double *)field <= 0.0) {
+                fprintf(stderr, "[i3lock] %s must be greater than 0.\n", options[index].name);
+                return false;
+            }
+            break;
+    }
+    return true;
+}
+
+/*
+ * Sets an option from the command line. Returns false if the value is
+ * invalid.
+ *
+ */
+bool theme_set_option(const char *key, const char *value) {
+    int index = find_option(key);
+    theme_t scratch;
+
+    if (index == -1 || !apply_option(&scratch, index, value))
+        return false;
+
+    free(overrides[index]);
+    overrides[index] = strdup(value);
+    return true;
+}
+
+/*
+ * Sets the path of the theme file, which is read by theme_compile().
+ *
+ */
+void theme_set_path(const char *path) {
+    free(theme_path);
+    theme_path = strdup(path);
+}
+
+/*
+ * Applies the options in the theme file. Returns false on errors.
+ *
+ */
+static bool read_theme_file(theme_t *new_theme) {
+    FILE *file = fopen(theme_path, "r");
+    char line[256];
+    int line_number = 0;
+    bool success = true;
+
+    if (file == NULL) {
+        fprintf(stderr, "[i3lock] Could not open theme \"%s\": %s\n", theme_path, strerror(errno));
+        return false;
+    }
+
+    while (success && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        /* Strip leading and trailing whitespace. */
+        char *key = line;
+        while (isspace((unsigned char)*key))
+            key++;
+        char *end = key + strlen(key);
+        while (end > key && isspace((unsigned char)end[-1]))
+            *(--end) = '\0';
+
+        if (*key == '\0' || *key == '#')
+            continue;
+
+        char *value = strchr(key, '=');
+        if (value == NULL) {
+            fprintf(stderr, "[i3lock] %s:%d: expected \"key = value\"\n", theme_path, line_number);
+            success = false;
+            break;
+        }
+
+        end = value;
+        while (end > key && isspace((unsigned char)end[-1]))
+            end--;
+        *end = '\0';
+        value++;
+        while (isspace((unsigned char)*value))
+            value++;
+
+        int index = find_option(key);
+        if (index == -1) {
+            fprintf(stderr, "[i3lock] %s:%d: unknown option \"%s\", ignoring it\n", theme_path, line_number, key);
+            continue;
+        }
+
+        /* Options given on the command line take precedence. */
+        if (overrides[index] != NULL)
+            continue;
+
+        if (!apply_option(new_theme, index, value)) {
+            fprintf(stderr, "[i3lock] in %s, line %d\n", theme_path, line_number);
+            success = false;
+        }
+    }
+
+    fclose(file);
+    return success;
+}
+
+/*
+ * Compiles a new theme from the defaults, the theme file (if any) and the
+ * command line options. Returns NULL (after printing why) if the theme file
+ * could not be read or contains invalid values.
+ *
+ */
+theme_t *theme_compile(void) {
+    theme_t *new_theme = calloc(sizeof(theme_t), 1);
+    if (new_theme == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < NUM_OPTIONS; i++)
+        apply_option(new_theme, i, (overrides[i] != NULL ? overrides[i] : defaults[i]));
+
+    if (theme_path != NULL && !read_theme_file(new_theme)) {
+        free(new_theme);
+        return NULL;
+    }
+
+    return new_theme;
+}
+
+static bool color_equal(const color_t *a, const color_t *b) {
+    return (a->pixel == b->pixel);
+}
+
+/*
+ * Returns what needs to be rendered again (a combination of
+ * theme_change_t) when switching from the old to the new theme.
+ *
+ */
+unsigned int theme_diff(const theme_t *old_theme, const theme_t *new_theme) {
+    unsigned int changes = 0;
+
+    if (!color_equal(&old_theme->background, &new_theme->background))
+        changes |= THEME_CHANGED_BACKGROUND;
+
+    if (!color_equal(&old_theme->icon, &new_theme->icon) ||
+        !color_equal(&old_theme->verify, &new_theme->verify) ||
+        !color_equal(&old_theme->wrong, &new_theme->wrong) ||
+        !color_equal(&old_theme->indicator, &new_theme->indicator) ||
+        !color_equal(&old_theme->border, &new_theme->border) ||
+        !color_equal(&old_theme->timeout, &new_theme->timeout) ||
+        old_theme->icon_scale != new_theme->icon_scale)
+        changes |= THEME_CHANGED_INDICATOR;
+
+    return changes;
+}
+
+/*
+ * Uses the given color as the source of the given cairo context.
+ *
+ */
+void theme_set_source(cairo_t *ctx, const color_t *color) {
+    cairo_set_source_rgb(ctx, color->red, color->green, color->blue);
+}
@@ -0,0 +1,46 @@
+#ifndef _THEME_H
+#define _THEME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cairo.h>
+
+typedef struct {
+    double red, green, blue; /* for cairo, 0.0 – 1.0 */
+    uint32_t pixel;          /* 0xrrggbb, see color_pixel() */
+} color_t;
+
+/* Everything which determines what the lock screen looks like, converted to
+ * the form in which the renderers use it. A theme is never modified, a
+ * reload compiles a new one (see theme_compile()). */
+typedef struct {
+    /* palette */
+    color_t background; /* --color */
+    color_t icon;       /* --color-icon, also used for text */
+    color_t verify;     /* --color-verify */
+    color_t wrong;      /* --color-wrong */
+    color_t indicator;  /* --color-bg */
+    color_t border;     /* --color-border */
+    color_t timeout;    /* --color-timeout */
+
+    /* layout */
+    double icon_scale; /* --icon_scale */
+} theme_t;
+
+/* What differs between two themes, see theme_diff(). */
+typedef enum {
+    THEME_CHANGED_BACKGROUND = (1 << 0),
+    THEME_CHANGED_INDICATOR = (1 << 1)
+} theme_change_t;
+
+/* The current theme, used for drawing. Replaced with set_theme() (see
+ * unlock_indicator.c) once the render thread runs. */
+extern const theme_t *theme;
+
+bool theme_set_option(const char *key, const char *value);
+void theme_set_path(const char *path);
+theme_t *theme_compile(void);
+unsigned int theme_diff(const theme_t *old_theme, const theme_t *new_theme);
+void theme_set_source(cairo_t *ctx, const color_t *color);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * timing.c: measures how long the individual startup phases take, so that
+ *           --debug shows what the time until the screen is locked is
+ *           spent on.
+ *
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "i3lock.h"
+#include "timing.h"
+
+extern bool debug_mode;
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_PAM_INIT] = "PAM init",
+    [PHASE_X_CONNECT] = "X connect",
+    [PHASE_XKB] = "XKB",
+    [PHASE_SCREENS] = "screens",
+    [PHASE_IMAGE_LOAD] = "image load",
+    [PHASE_EFFECTS] = "effects",
+    [PHASE_MAP] = "map",
+    [PHASE_GRAB] = "grab",
+};
+
+/* The same, as used in the readiness notification (see phase_summary()). */
+static const char *phase_keys[PHASE_COUNT] = {
+    [PHASE_PAM_INIT] = "pam_init",
+    [PHASE_X_CONNECT] = "x_connect",
+    [PHASE_XKB] = "xkb",
+    [PHASE_SCREENS] = "screens",
+    [PHASE_IMAGE_LOAD] = "image_load",
+    [PHASE_EFFECTS] = "effects",
+    [PHASE_MAP] = "map",
+    [PHASE_GRAB] = "grab",
+};
+
+static double phase_start[PHASE_COUNT];
+static double phase_duration[PHASE_COUNT];
+
+/* When the first phase began, 0 if none did yet. */
+static double first_start;
+
+/*
+ * Returns a monotonic timestamp in milliseconds.
+ *
+ */
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void phase_begin(startup_phase_t phase) {
+    phase_start[phase] = now_ms();
+    if (first_start == 0)
+        first_start = phase_start[phase];
+}
+
+void phase_end(startup_phase_t phase) {
+    phase_duration[phase] += now_ms() - phase_start[phase];
+}
+
+/*
+ * Prints the duration of every phase and the total time since the first
+ * phase began (phases can overlap, so they don’t necessarily add up).
+ *
+ */
+void phase_report(void) {
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        DEBUG("phase %-10s %8.2f ms\n", phase_names[phase], phase_duration[phase]);
+    DEBUG("phase %-10s %8.2f ms\n", "total", now_ms() - first_start);
+}
+
+/*
+ * Writes the duration of every phase and the total, in milliseconds, as
+ * “key=value” pairs separated by spaces, e.g. “pam_init=12.50 ... total=80.21”.
+ *
+ */
+void phase_summary(char *buf, size_t size) {
+    size_t used = 0;
+    for (int phase = 0; phase <= PHASE_COUNT && used < size; phase++) {
+        int n;
+        if (phase < PHASE_COUNT)
+            n = snprintf(buf + used, size - used, "%s=%.2f ", phase_keys[phase], phase_duration[phase]);
+        else
+            n = snprintf(buf + used, size - used, "total=%.2f", now_ms() - first_start);
+        if (n < 0)
+            break;
+        used += n;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef _TIMING_H
+#define _TIMING_H
+
+#include <stddef.h>
+
+typedef enum {
+    PHASE_PAM_INIT = 0, /* waiting for the authentication helper */
+    PHASE_X_CONNECT,    /* connecting to X11, prefetching extensions */
+    PHASE_XKB,          /* setting up XKB and loading the keymap */
+    PHASE_SCREENS,      /* querying the Xinerama screens */
+    PHASE_IMAGE_LOAD,   /* loading the image (-i) or wallpaper (-w) */
+    PHASE_EFFECTS,      /* applying effects (-D) */
+    PHASE_MAP,          /* drawing the first frame until MapNotify */
+    PHASE_GRAB,         /* grabbing pointer and keyboard */
+    PHASE_COUNT
+} startup_phase_t;
+
+double now_ms(void);
+void phase_begin(startup_phase_t phase);
+void phase_end(startup_phase_t phase);
+void phase_report(void);
+void phase_summary(char *buf, size_t size);
+
+#endif
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include <xcb/xcb.h>
 #include <ev.h>
 #include <cairo.h>
@@ -19,14 +20,17 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "unlock_indicator.h"
+#include "render.h"
 #include "xinerama.h"
+#include "text.h"
+#include "theme.h"
 
 #define sq2 1.41421356237
 
-#define ICON_RADIUS (25 * icon_scale)
-#define ICON_CENTER (42 * icon_scale)
+#define ICON_RADIUS (25 * theme->icon_scale)
+#define ICON_CENTER (42 * theme->icon_scale)
 #define ICON_SIZE   (2  * ICON_CENTER)
-#define BG_SCALE    (15 * icon_scale)
+#define BG_SCALE    (15 * theme->icon_scale)
 
 /*******************************************************************************
  * Variables defined in i3lock.c.
@@ -48,29 +52,24 @@ extern uint32_t last_resolution[2];
 extern bool unlock_indicator;
 
 /* List of pressed modifiers, or NULL if none are pressed. */
-extern char *modifier_string;
-
-/* A Cairo surface containing the specified image (-i), if any. */
-extern cairo_surface_t *img;
+extern const char *modifier_string;
 
 /* Whether the image should be tiled. */
 extern bool tile;
-/* The background color to use (in hex). */
-extern char color[7];
-
-extern char color_icon[7];
-extern char color_verify[7];
-extern char color_wrong[7];
-extern char color_bg[7];
-extern char color_border[7];
-
-extern double icon_scale;
 
 /* Whether the failed attempts should be displayed. */
 extern bool show_failed_attempts;
 /* Number of failed unlock attempts. */
 extern int failed_attempts;
 
+/* Whether the display is blanked, in which case there is no point in
+ * drawing. */
+extern bool display_blanked;
+
+/* Whether to only send what changed in the unlock indicator (--low-bandwidth),
+ * see redraw_indicator(). */
+extern bool low_bandwidth;
+
 /*******************************************************************************
  * Variables defined in xcb.c.
  ******************************************************************************/
@@ -86,10 +85,85 @@ extern xcb_screen_t *screen;
 static xcb_visualtype_t *vistype;
 
 /* Maintain the current unlock/PAM state to draw the appropriate unlock
- * indicator. */
+ * indicator. The main thread posts a copy with every redraw. */
 unlock_state_t unlock_state;
 pam_state_t pam_state;
 
+/* What was last posted to the render thread, so that the screens and the
+ * theme are only posted when they change. Only used by the main thread. */
+static uint32_t posted_resolution[2];
+static Rect *posted_areas = NULL;
+static int posted_num_areas = -1;
+static const theme_t *posted_theme = NULL;
+static bool next_background_posted = false;
+
+/* Everything below is only used on the render thread (see render.c), which
+ * is the main thread until render_attach(). */
+
+/* The connection on which is drawn. */
+static xcb_connection_t *draw_conn;
+
+/* The state to draw (see render_state_t), and the resolution of the root
+ * window and the screens in it, as posted by the main thread. */
+static render_state_t state;
+static uint32_t root_resolution[2];
+static Rect *screen_rects = NULL;
+static int num_screen_rects = 0;
+
+/* Which redraws were posted since the last frame, see render_flush(). */
+static bool screen_pending = false;
+static bool text_pending = false;
+
+/* The background (image or color) at the current resolution, rendered once
+ * and retained on the X server. Every frame starts out as a copy of it. */
+static xcb_pixmap_t background_pixmap = XCB_NONE;
+static uint32_t background_resolution[2];
+static xcb_gcontext_t background_gc = XCB_NONE;
+/* What the background is rendered from, if anything: the image (decoded,
+ * within --max-image-memory), uploaded once and unscaled (see
+ * upload_source()), or the copy of the wallpaper. Both are on the X server,
+ * the decoded image is released after the upload. Kept to render the
+ * background again for a new resolution or background color, see
+ * set_background_source(). */
+static cairo_surface_t *source_upload = NULL;
+static double source_scale = 1.0;
+static xcb_pixmap_t source_pixmap = XCB_NONE;
+static uint32_t source_resolution[2];
+/* The background which is switched to next (see switch_background()), already
+ * rendered on the X server, and the upload it was rendered from. XCB_NONE if
+ * none was prepared. */
+static xcb_pixmap_t next_background_pixmap = XCB_NONE;
+static uint32_t next_background_resolution[2];
+static cairo_surface_t *next_source_upload = NULL;
+static double next_source_scale = 1.0;
+
+/* The current frame (background, unlock indicator and text), which is the
+ * background pixmap of the lock window. It is kept around so that parts of it
+ * can be updated, see redraw_text(). */
+static xcb_pixmap_t frame_pixmap = XCB_NONE;
+static uint32_t frame_resolution[2];
+
+/* The unlock indicator of the current frame, uploaded once to the X server,
+ * from where it is composited onto every screen (see draw_frame()). It is
+ * kept around, since the size rarely changes. */
+static cairo_surface_t *indicator_surface = NULL;
+static int indicator_surface_size;
+
+/* With --low-bandwidth, the unlock indicator as it was last drawn into
+ * frame_pixmap, and the areas it was drawn in. NULL if the next frame needs
+ * to be drawn completely. */
+static cairo_surface_t *shown_indicator = NULL;
+static Rect *shown_areas = NULL;
+static int shown_num_areas = 0;
+
+/* The bytes sent to the X server per frame, see frame_stats(). The main
+ * thread reads them. */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static frame_stats_t stats;
+#if defined(HAVE_XCB_TOTAL_WRITTEN)
+static uint64_t frame_written;
+#endif
+
 /*
  * Returns the scaling factor of the current screen. E.g., on a 227 DPI MacBook
  * Pro 13" Retina screen, the scaling factor is 227/96 = 2.36.
@@ -102,107 +176,342 @@ static double scaling_factor(void) {
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Returns the cairo format whose pixels are laid out like those of the root
+ * visual of the given screen, so that images in it can be sent to the X
+ * server as they are (see images_set_format()). CAIRO_FORMAT_INVALID if there
+ * is none, in which case cairo converts them.
  *
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-    xcb_pixmap_t bg_pixmap = XCB_NONE;
-    int button_diameter_physical = ceil(scaling_factor() * ICON_SIZE);
-    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
-          scaling_factor(), button_diameter_physical);
+cairo_format_t screen_format(xcb_connection_t *conn, xcb_screen_t *scr) {
+    xcb_visualtype_t *visual = get_root_visual_type(scr);
+    if (visual == NULL || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR)
+        return CAIRO_FORMAT_INVALID;
+
+    /* cairo’s formats use the byte order of the host. */
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    const uint16_t one = 1;
+    const uint8_t host_order = (*(const uint8_t *)&one == 1 ? XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST);
+    if (setup->image_byte_order != host_order)
+        return CAIRO_FORMAT_INVALID;
+
+    int bits_per_pixel = 0;
+    for (xcb_format_iterator_t format = xcb_setup_pixmap_formats_iterator(setup);
+         format.rem;
+         xcb_format_next(&format))
+        if (format.data->depth == scr->root_depth)
+            bits_per_pixel = format.data->bits_per_pixel;
+
+    const uint32_t red = visual->red_mask;
+    const uint32_t green = visual->green_mask;
+    const uint32_t blue = visual->blue_mask;
+    cairo_format_t result = CAIRO_FORMAT_INVALID;
+    if (scr->root_depth == 24 && bits_per_pixel == 32 &&
+        red == 0xff0000 && green == 0x00ff00 && blue == 0x0000ff)
+        result = CAIRO_FORMAT_RGB24;
+    else if (scr->root_depth == 30 && bits_per_pixel == 32 &&
+             red == 0x3ff00000 && green == 0x000ffc00 && blue == 0x000003ff)
+        result = CAIRO_FORMAT_RGB30;
+    else if (scr->root_depth == 16 && bits_per_pixel == 16 &&
+             red == 0xf800 && green == 0x07e0 && blue == 0x001f)
+        result = CAIRO_FORMAT_RGB16_565;
+
+    DEBUG("root visual: depth %d, %d bpp, masks %06x/%06x/%06x, cairo format %d\n",
+          scr->root_depth, bits_per_pixel, red, green, blue, result);
+    return result;
+}
+
+/*
+ * Makes the next frame a complete one, even with --low-bandwidth.
+ *
+ */
+static void discard_shown_indicator(void) {
+    if (shown_indicator == NULL)
+        return;
+    cairo_surface_destroy(shown_indicator);
+    shown_indicator = NULL;
+}
+
+/*
+ * Starts counting the bytes which are sent to the X server for a frame.
+ * Requests which are still buffered belong to the previous frame.
+ *
+ */
+static void frame_begin(void) {
+#if defined(HAVE_XCB_TOTAL_WRITTEN)
+    xcb_flush(draw_conn);
+    frame_written = xcb_total_written(draw_conn);
+#endif
+}
+
+/*
+ * Stops counting, after the frame was flushed.
+ *
+ */
+static void frame_end(const char *what) {
+#if defined(HAVE_XCB_TOTAL_WRITTEN)
+    const uint64_t bytes = xcb_total_written(draw_conn) - frame_written;
+#else
+    /* Not known with libxcb < 1.14. */
+    const uint64_t bytes = 0;
+#endif
+    pthread_mutex_lock(&stats_lock);
+    stats.frames++;
+    stats.last_bytes = bytes;
+    stats.total_bytes += bytes;
+    if (bytes > stats.max_bytes)
+        stats.max_bytes = bytes;
+    pthread_mutex_unlock(&stats_lock);
+    DEBUG("%s: sent %llu bytes to the X server\n", what, (unsigned long long)bytes);
+}
 
+/*
+ * Returns how many bytes were sent to the X server for the frames drawn so
+ * far (by redraw_screen() and redraw_text()).
+ *
+ */
+frame_stats_t frame_stats(void) {
+    pthread_mutex_lock(&stats_lock);
+    frame_stats_t copy = stats;
+    pthread_mutex_unlock(&stats_lock);
+    return copy;
+}
+
+/*
+ * Paints the given source (scaled up by 1/scale) at the top left corner, or
+ * tiled across the whole area.
+ *
+ */
+static void paint_source(cairo_t *ctx, cairo_surface_t *source, double scale, uint32_t *resolution) {
+    cairo_pattern_t *pattern = cairo_pattern_create_for_surface(source);
+    cairo_matrix_t matrix;
+    cairo_matrix_init_scale(&matrix, scale, scale);
+    cairo_pattern_set_matrix(pattern, &matrix);
+    cairo_set_source(ctx, pattern);
+    if (!tile) {
+        cairo_paint(ctx);
+    } else {
+        /* fill a rectangle as big as the screen */
+        cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+        cairo_rectangle(ctx, 0, 0, resolution[0], resolution[1]);
+        cairo_fill(ctx);
+    }
+    cairo_pattern_destroy(pattern);
+}
+
+/*
+ * Creates a pixmap with the given resolution, filled with the background
+ * color, and paints the given source (if any) on it.
+ *
+ */
+static xcb_pixmap_t render_pixmap(cairo_surface_t *source, double scale, uint32_t *resolution) {
     if (!vistype)
         vistype = get_root_visual_type(screen);
-    bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, button_diameter_physical, button_diameter_physical);
-    cairo_t *ctx = cairo_create(output);
+    xcb_pixmap_t pixmap = create_bg_pixmap(draw_conn, screen, resolution, color_pixel(vistype, &theme->background));
 
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
+    if (source) {
+        cairo_surface_t *xcb_output = cairo_xcb_surface_create(draw_conn, pixmap, vistype, resolution[0], resolution[1]);
+        cairo_t *xcb_ctx = cairo_create(xcb_output);
+        paint_source(xcb_ctx, source, scale, resolution);
+        cairo_destroy(xcb_ctx);
+        cairo_surface_destroy(xcb_output);
+    }
+    return pixmap;
+}
 
-    if (img) {
-        if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
-        } else {
-            /* create a pattern and fill a rectangle as big as the screen */
-            cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
-            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
-            cairo_pattern_destroy(pattern);
-        }
+/*
+ * Makes the given pixmap (with the given resolution) the background.
+ *
+ */
+static void set_background(xcb_pixmap_t pixmap, uint32_t *resolution) {
+    if (background_pixmap != XCB_NONE)
+        xcb_free_pixmap(draw_conn, background_pixmap);
+    else {
+        background_gc = xcb_generate_id(draw_conn);
+        xcb_create_gc(draw_conn, background_gc, pixmap, 0, NULL);
+    }
+    background_pixmap = pixmap;
+    background_resolution[0] = resolution[0];
+    background_resolution[1] = resolution[1];
+    discard_shown_indicator();
+}
+
+/*
+ * Uploads the given image to the X server, as it is (the scale is applied
+ * when rendering from it), and releases the image. Returns a surface backed
+ * by a pixmap, with an alpha channel if the image has one, so that it can
+ * be put onto any background color later.
+ *
+ */
+static cairo_surface_t *upload_source(cairo_surface_t *image) {
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+    cairo_surface_t *root = cairo_xcb_surface_create(draw_conn, screen->root, vistype, 1, 1);
+    cairo_surface_t *upload = cairo_surface_create_similar(root, cairo_surface_get_content(image),
+                                                           cairo_image_surface_get_width(image),
+                                                           cairo_image_surface_get_height(image));
+    cairo_surface_destroy(root);
+
+    cairo_t *ctx = cairo_create(upload);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(ctx, image, 0, 0);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_flush(upload);
+    cairo_surface_destroy(image);
+    return upload;
+}
+
+/*
+ * (Re-)renders background_pixmap for the given resolution from the source
+ * (see set_background_source()), if any.
+ *
+ */
+static void render_background(uint32_t *resolution) {
+    xcb_pixmap_t pixmap;
+
+    if (source_upload != NULL) {
+        pixmap = render_pixmap(source_upload, source_scale, resolution);
+    } else if (source_pixmap != XCB_NONE) {
+        cairo_surface_t *wallpaper = cairo_xcb_surface_create(draw_conn, source_pixmap, vistype,
+                                                              source_resolution[0], source_resolution[1]);
+        pixmap = render_pixmap(wallpaper, 1.0, resolution);
+        cairo_surface_destroy(wallpaper);
     } else {
-        char strgroups[3][3] = {{color[0], color[1], '\0'},
-                                {color[2], color[3], '\0'},
-                                {color[4], color[5], '\0'}};
-        uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                             (strtol(strgroups[1], NULL, 16)),
-                             (strtol(strgroups[2], NULL, 16))};
-        cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-        cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-        cairo_fill(xcb_ctx);
+        pixmap = render_pixmap(NULL, 1.0, resolution);
+    }
+
+    set_background(pixmap, resolution);
+    DEBUG("rendered background at %ux%u\n", resolution[0], resolution[1]);
+}
+
+/*
+ * Paints the given image (a frame of an animation, see animation.c) onto the
+ * current background, instead of rendering a new one.
+ *
+ */
+static void paint_background_frame(cairo_surface_t *image, double scale) {
+    if (background_pixmap == XCB_NONE)
+        return;
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(draw_conn, background_pixmap, vistype,
+                                                           background_resolution[0], background_resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+    /* Frames may be transparent, unless they were converted already (see
+     * images_convert()). */
+    if (cairo_surface_get_content(image) != CAIRO_CONTENT_COLOR) {
+        theme_set_source(xcb_ctx, &theme->background);
+        cairo_paint(xcb_ctx);
     }
+    paint_source(xcb_ctx, image, scale, background_resolution);
+    cairo_destroy(xcb_ctx);
+    cairo_surface_destroy(xcb_output);
+    discard_shown_indicator();
+}
+
+/*
+ * Renders the given image (see images.c) into next_background_pixmap, which
+ * replaces the background on the next use_next_background(). Takes over the
+ * reference to the image, whose upload becomes the source of the background
+ * then.
+ *
+ */
+static void render_next_background(cairo_surface_t *image, double scale) {
+    if (next_background_pixmap != XCB_NONE)
+        xcb_free_pixmap(draw_conn, next_background_pixmap);
+    if (next_source_upload != NULL)
+        cairo_surface_destroy(next_source_upload);
+    next_source_upload = upload_source(image);
+    next_source_scale = scale;
+
+    next_background_pixmap = render_pixmap(next_source_upload, scale, root_resolution);
+    next_background_resolution[0] = root_resolution[0];
+    next_background_resolution[1] = root_resolution[1];
+    xcb_flush(draw_conn);
+    DEBUG("prepared the next background at %ux%u\n", root_resolution[0], root_resolution[1]);
+}
+
+/*
+ * Switches to the prepared background, if any, without touching the image
+ * again.
+ *
+ */
+static void use_next_background(void) {
+    if (next_background_pixmap == XCB_NONE)
+        return;
+
+    /* If the resolution changed since, draw_frame() renders it again. */
+    set_background(next_background_pixmap, next_background_resolution);
+    next_background_pixmap = XCB_NONE;
+
+    if (source_upload != NULL)
+        cairo_surface_destroy(source_upload);
+    source_upload = next_source_upload;
+    source_scale = next_source_scale;
+    next_source_upload = NULL;
+}
+
+/*
+ * Makes the next frame render the background again, e.g. because the
+ * background color changed.
+ *
+ */
+static void forget_background(void) {
+    background_resolution[0] = 0;
+    background_resolution[1] = 0;
+}
+
+/*
+ * Replaces the source of the background, see set_background_source().
+ *
+ */
+static void use_background_source(cairo_surface_t *image, double scale,
+                                  xcb_pixmap_t pixmap, const uint32_t *resolution) {
+    if (source_upload != NULL)
+        cairo_surface_destroy(source_upload);
+    if (source_pixmap != XCB_NONE)
+        xcb_free_pixmap(draw_conn, source_pixmap);
+    source_upload = (image != NULL ? upload_source(image) : NULL);
+    source_scale = scale;
+    source_pixmap = pixmap;
+    source_resolution[0] = resolution[0];
+    source_resolution[1] = resolution[1];
+    forget_background();
+}
 
-    char strgroups_base[3][3] = {
-        {color_icon[0], color_icon[1], '\0'},
-        {color_icon[2], color_icon[3], '\0'},
-        {color_icon[4], color_icon[5], '\0'}};
-    uint32_t rgb16_base[3] = {
-        (strtol(strgroups_base[0], NULL, 16)),
-        (strtol(strgroups_base[1], NULL, 16)),
-        (strtol(strgroups_base[2], NULL, 16))};
-
-    char strgroups_verify[3][3] = {
-        {color_verify[0], color_verify[1], '\0'},
-        {color_verify[2], color_verify[3], '\0'},
-        {color_verify[4], color_verify[5], '\0'}};
-    uint32_t rgb16_verify[3] = {
-        (strtol(strgroups_verify[0], NULL, 16)),
-        (strtol(strgroups_verify[1], NULL, 16)),
-        (strtol(strgroups_verify[2], NULL, 16))};
-
-    char strgroups_wrong[3][3] = {
-        {color_wrong[0], color_wrong[1], '\0'},
-        {color_wrong[2], color_wrong[3], '\0'},
-        {color_wrong[4], color_wrong[5], '\0'}};
-    uint32_t rgb16_wrong[3] = {
-        (strtol(strgroups_wrong[0], NULL, 16)),
-        (strtol(strgroups_wrong[1], NULL, 16)),
-        (strtol(strgroups_wrong[2], NULL, 16))};
-
-    char strgroups_bg[3][3] = {
-        {color_bg[0], color_bg[1], '\0'},
-        {color_bg[2], color_bg[3], '\0'},
-        {color_bg[4], color_bg[5], '\0'}};
-    uint32_t rgb16_bg[3] = {
-        (strtol(strgroups_bg[0], NULL, 16)),
-        (strtol(strgroups_bg[1], NULL, 16)),
-        (strtol(strgroups_bg[2], NULL, 16))};
-
-    char strgroups_border[3][3] = {
-        {color_border[0], color_border[1], '\0'},
-        {color_border[2], color_border[3], '\0'},
-        {color_border[4], color_border[5], '\0'}};
-    uint32_t rgb16_border[3] = {
-        (strtol(strgroups_border[0], NULL, 16)),
-        (strtol(strgroups_border[1], NULL, 16)),
-        (strtol(strgroups_border[2], NULL, 16))};
+/*
+ * Returns the areas (screens) in which the unlock indicator and the text are
+ * centered. fallback is used when there is no information about the screens.
+ *
+ */
+static int screen_areas(const Rect **areas, Rect *fallback) {
+    if (num_screen_rects > 0) {
+        *areas = screen_rects;
+        return num_screen_rects;
+    }
+    /* We have no information about the screen sizes/positions, so we just
+     * place everything in the middle of the X root window and hope for the
+     * best. */
+    fallback->x = 0;
+    fallback->y = 0;
+    fallback->width = root_resolution[0];
+    fallback->height = root_resolution[1];
+    *areas = fallback;
+    return 1;
+}
 
+/*
+ * Draws the unlock indicator (if enabled) with its top left corner at the
+ * origin of the given context.
+ *
+ */
+static void draw_indicator(cairo_t *ctx) {
     if (unlock_indicator) {
         cairo_scale(ctx, scaling_factor(), scaling_factor());
         cairo_set_line_cap(ctx, CAIRO_LINE_CAP_ROUND);
         cairo_set_line_join(ctx, CAIRO_LINE_JOIN_ROUND);
 
         /* draw the background octagon */
-        cairo_set_source_rgb(ctx, 
-                rgb16_bg[0] / 255.0, rgb16_bg[1] / 255.0, rgb16_bg[2] / 255.0);
+        theme_set_source(ctx, &theme->indicator);
         cairo_set_line_width(ctx, 1);
         cairo_move_to(ctx, ( (1 + sq2) * BG_SCALE)+ICON_CENTER, (  1        * BG_SCALE)+ICON_CENTER);
         cairo_line_to(ctx, (  1        * BG_SCALE)+ICON_CENTER, ( (1 + sq2) * BG_SCALE)+ICON_CENTER);
@@ -217,9 +526,8 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
         cairo_fill(ctx);
 
         /* draw the octagon border */
-        cairo_set_source_rgb(ctx,
-                rgb16_border[0] / 255.0, rgb16_border[1] / 255.0, rgb16_border[2] / 255.0);
-        cairo_set_line_width(ctx, 3*icon_scale);
+        theme_set_source(ctx, &theme->border);
+        cairo_set_line_width(ctx, 3*theme->icon_scale);
         cairo_move_to(ctx, ( (1 + sq2) * BG_SCALE)+ICON_CENTER, (  1        * BG_SCALE)+ICON_CENTER);
         cairo_line_to(ctx, (  1        * BG_SCALE)+ICON_CENTER, ( (1 + sq2) * BG_SCALE)+ICON_CENTER);
         cairo_line_to(ctx, (- 1        * BG_SCALE)+ICON_CENTER, ( (1 + sq2) * BG_SCALE)+ICON_CENTER);
@@ -235,77 +543,76 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
         //cairo_fill(ctx);
 
         /* Draw outer circle, using appropriate color */
-        switch(pam_state) {
+        switch(state.pam_state) {
             case STATE_PAM_IDLE:
-                cairo_set_source_rgb(ctx,
-                        rgb16_base[0] / 255.0, rgb16_base[1] / 255.0, rgb16_base[2] / 255.0);
+                theme_set_source(ctx, &theme->icon);
                 break;
             case STATE_PAM_VERIFY:
-                cairo_set_source_rgb(ctx,
-                        rgb16_verify[0] / 255.0, rgb16_verify[1] / 255.0, rgb16_verify[2] / 255.0);
+                theme_set_source(ctx, &theme->verify);
                 break;
             case STATE_PAM_WRONG:
-                cairo_set_source_rgb(ctx,
-                        rgb16_wrong[0] / 255.0, rgb16_wrong[1] / 255.0, rgb16_wrong[2] / 255.0);
+                theme_set_source(ctx, &theme->wrong);
+                break;
+            case STATE_PAM_TIMEOUT:
+                theme_set_source(ctx, &theme->timeout);
                 break;
         }
 
         /* Draw the lock icon */
-        //cairo_set_line_width(ctx, 3 * icon_scale);
+        //cairo_set_line_width(ctx, 3 * theme->icon_scale);
         //cairo_arc(ctx, ICON_CENTER, ICON_CENTER, ICON_RADIUS, 0, 2 * M_PI);
         //cairo_stroke(ctx);
 
         /* Draw keyhole */
         //cairo_set_source_rgb(ctx,
         //        rgb16_base[0] / 255.0, rgb16_base[1] / 255.0, rgb16_base[2] / 255.0);
-        cairo_set_line_width(ctx, icon_scale);
-        cairo_arc(ctx, ICON_CENTER, ICON_CENTER + 4 * icon_scale, 3 * icon_scale, 0, 2 * M_PI);
+        cairo_set_line_width(ctx, theme->icon_scale);
+        cairo_arc(ctx, ICON_CENTER, ICON_CENTER + 4 * theme->icon_scale, 3 * theme->icon_scale, 0, 2 * M_PI);
         cairo_fill(ctx);
 
-        cairo_set_line_width(ctx, 3 * icon_scale);
-        cairo_move_to(ctx, ICON_CENTER, ICON_CENTER + 4 * icon_scale);
-        cairo_rel_line_to(ctx, 0.0, 4.5 * icon_scale);
+        cairo_set_line_width(ctx, 3 * theme->icon_scale);
+        cairo_move_to(ctx, ICON_CENTER, ICON_CENTER + 4 * theme->icon_scale);
+        cairo_rel_line_to(ctx, 0.0, 4.5 * theme->icon_scale);
         cairo_stroke(ctx);
 
         /* Draw body */
-        cairo_rectangle(ctx, ICON_CENTER - 11 * icon_scale, ICON_CENTER - 4 * icon_scale, 22 * icon_scale, 19 * icon_scale);
+        cairo_rectangle(ctx, ICON_CENTER - 11 * theme->icon_scale, ICON_CENTER - 4 * theme->icon_scale, 22 * theme->icon_scale, 19 * theme->icon_scale);
         cairo_stroke(ctx);
 
         /* Draw arm */
-        cairo_arc(ctx, ICON_CENTER, ICON_CENTER - 11 * icon_scale, 7.5 * icon_scale, M_PI, 0);
+        cairo_arc(ctx, ICON_CENTER, ICON_CENTER - 11 * theme->icon_scale, 7.5 * theme->icon_scale, M_PI, 0);
         cairo_stroke(ctx);
 
-        cairo_move_to(ctx, ICON_CENTER - 7.5 * icon_scale, ICON_CENTER - 11 * icon_scale);
-        cairo_rel_line_to(ctx, 0, 7 * icon_scale);
+        cairo_move_to(ctx, ICON_CENTER - 7.5 * theme->icon_scale, ICON_CENTER - 11 * theme->icon_scale);
+        cairo_rel_line_to(ctx, 0, 7 * theme->icon_scale);
         cairo_stroke(ctx);
 
-        cairo_move_to(ctx, ICON_CENTER + 7.5 * icon_scale, ICON_CENTER - 11 * icon_scale);
-        cairo_rel_line_to(ctx, 0, 7 * icon_scale);
+        cairo_move_to(ctx, ICON_CENTER + 7.5 * theme->icon_scale, ICON_CENTER - 11 * theme->icon_scale);
+        cairo_rel_line_to(ctx, 0, 7 * theme->icon_scale);
         cairo_stroke(ctx);
 
-        cairo_set_source_rgb(ctx,
-                rgb16_base[0] / 255.0, rgb16_base[1] / 255.0, rgb16_base[2] / 255.0);
+        theme_set_source(ctx, &theme->icon);
 
         /* Draw dots for password */
-        if (input_position > 0) {
+        if (state.input_position > 0) {
             /* Color dots red if caps lock is on */
-            if (modifier_string != NULL && strcmp(modifier_string, "Caps Lock") == 0) {
-                cairo_set_source_rgb(ctx, rgb16_wrong[0] / 255.0, rgb16_wrong[1] / 255.0, rgb16_wrong[2] / 255.0);
+            if (state.caps_lock) {
+                theme_set_source(ctx, &theme->wrong);
             }
 
             int i;
             //double between = 3;
-            //double radius = icon_scale;
-            //double full_length = (between + cairo_get_line_width(ctx) + 2*radius) * (input_position-1);
+            //double radius = theme->icon_scale;
+            //double full_length = (between + cairo_get_line_width(ctx) + 2*radius) * (state.input_position-1);
             //double index = -full_length/2;
 
-            double dot_arc = (M_PI / 2.0) - ((M_PI / 25.0) * (input_position - 1) / 2.0);
-            for(i = 0; i < input_position; ++i) {
-                cairo_arc(ctx, ICON_CENTER, ICON_CENTER, ICON_RADIUS + 1.5 * icon_scale, dot_arc, dot_arc);
+            double dot_arc = (M_PI / 2.0) - ((M_PI / 25.0) * (state.input_position - 1) / 2.0);
+            for(i = 0; i < state.input_position; ++i) {
+                cairo_arc(ctx, ICON_CENTER, ICON_CENTER, ICON_RADIUS + 1.5 * theme->icon_scale, dot_arc, dot_arc);
                 cairo_stroke(ctx);
                 dot_arc += M_PI / 25.0;
 
-                //cairo_arc(ctx, ((double)ICON_CENTER)+index, ICON_CENTER+(22*icon_scale), radius, 0, 2.0 * M_PI);
+                //cairo_arc(ctx, ((double)ICON_CENTER)+index, ICON_CENTER+(22*theme->icon_scale), radius, 0, 2.0 * M_PI);
                 //cairo_stroke(ctx);
                 //index += (2.0*radius) + cairo_get_line_width(ctx) + between;
             }
@@ -313,47 +620,633 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
         // x, y, r,  angle1, angle2
 
     }
+}
+
+/*
+ * Renders the unlock indicator into a new image of the given size, which the
+ * caller destroys.
+ *
+ */
+static cairo_surface_t *render_indicator(int diameter) {
+    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, diameter, diameter);
+    cairo_t *ctx = cairo_create(output);
+    draw_indicator(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_flush(output);
+    return output;
+}
+
+/*
+ * Draws global image with fill color onto the frame pixmap with the given
+ * resolution and returns it. The frame pixmap must not be freed by the
+ * caller.
+ *
+ */
+static xcb_pixmap_t draw_frame(uint32_t *resolution) {
+    xcb_pixmap_t bg_pixmap = XCB_NONE;
+    int button_diameter_physical = ceil(scaling_factor() * ICON_SIZE);
+    DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
+          scaling_factor(), button_diameter_physical);
+
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    if (background_pixmap == XCB_NONE ||
+        background_resolution[0] != resolution[0] ||
+        background_resolution[1] != resolution[1])
+        render_background(resolution);
+
+    if (frame_pixmap == XCB_NONE ||
+        frame_resolution[0] != resolution[0] ||
+        frame_resolution[1] != resolution[1]) {
+        /* The window keeps a reference to its background pixmap. */
+        if (frame_pixmap != XCB_NONE)
+            xcb_free_pixmap(draw_conn, frame_pixmap);
+        frame_pixmap = xcb_generate_id(draw_conn);
+        xcb_create_pixmap(draw_conn, screen->root_depth, frame_pixmap, screen->root,
+                          resolution[0], resolution[1]);
+        frame_resolution[0] = resolution[0];
+        frame_resolution[1] = resolution[1];
+    }
+    bg_pixmap = frame_pixmap;
+
+    /* Start out with a copy of the background, which does not leave the X
+     * server. */
+    xcb_copy_area(draw_conn, background_pixmap, bg_pixmap, background_gc,
+                  0, 0, 0, 0, resolution[0], resolution[1]);
+
+    /* Initialize cairo: Render the unlock indicator into an in-memory
+     * surface, create one XCB surface to actually draw (one or more,
+     * depending on the amount of screens) unlock indicators on. */
+    cairo_surface_t *output = render_indicator(button_diameter_physical);
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(draw_conn, bg_pixmap, vistype, resolution[0], resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    /* Upload the unlock indicator once, instead of once per screen. */
+    if (!low_bandwidth) {
+        if (indicator_surface != NULL && indicator_surface_size != button_diameter_physical) {
+            cairo_surface_destroy(indicator_surface);
+            indicator_surface = NULL;
+        }
+        if (indicator_surface == NULL) {
+            indicator_surface = cairo_surface_create_similar(xcb_output, CAIRO_CONTENT_COLOR_ALPHA,
+                                                             button_diameter_physical, button_diameter_physical);
+            indicator_surface_size = button_diameter_physical;
+        }
+        cairo_t *ctx = cairo_create(indicator_surface);
+        cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface(ctx, output, 0, 0);
+        cairo_paint(ctx);
+        cairo_destroy(ctx);
+    }
 
-    if (xr_screens > 0) {
-        /* Composite the unlock indicator in the middle of each screen. */
-        for (int screen = 0; screen < xr_screens; screen++) {
-            int x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (button_diameter_physical / 2)));
-            int y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (button_diameter_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, output, x, y);
+    /* Composite the unlock indicator in the middle of each screen and draw
+     * the text around it. */
+    const Rect *areas;
+    Rect fallback;
+    int num_areas = screen_areas(&areas, &fallback);
+    for (int i = 0; i < num_areas; i++) {
+        int x = (areas[i].x + ((areas[i].width / 2) - (button_diameter_physical / 2)));
+        int y = (areas[i].y + ((areas[i].height / 2) - (button_diameter_physical / 2)));
+        if (low_bandwidth) {
+            /* Drawing requests are much smaller than the image. */
+            cairo_save(xcb_ctx);
+            cairo_translate(xcb_ctx, x, y);
+            draw_indicator(xcb_ctx);
+            cairo_restore(xcb_ctx);
+        } else {
+            cairo_set_source_surface(xcb_ctx, indicator_surface, x, y);
             cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
             cairo_fill(xcb_ctx);
         }
-    } else {
-        /* We have no information about the screen sizes/positions, so we just
-         * place the unlock indicator in the middle of the X root window and
-         * hope for the best. */
-        int x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
-        int y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
-        cairo_set_source_surface(xcb_ctx, output, x, y);
-        cairo_rectangle(xcb_ctx, x, y, button_diameter_physical, button_diameter_physical);
-        cairo_fill(xcb_ctx);
+
+        text_draw(xcb_ctx, &areas[i], button_diameter_physical, scaling_factor());
     }
+    text_mark_clean();
 
     cairo_surface_destroy(xcb_output);
-    cairo_surface_destroy(output);
-    cairo_destroy(ctx);
     cairo_destroy(xcb_ctx);
+
+    discard_shown_indicator();
+    free(shown_areas);
+    shown_areas = NULL;
+    /* Remember what was drawn, see redraw_indicator(). No memory? Then the
+     * next frame is drawn completely, too. */
+    if (low_bandwidth && (shown_areas = malloc(num_areas * sizeof(Rect))) != NULL) {
+        memcpy(shown_areas, areas, num_areas * sizeof(Rect));
+        shown_num_areas = num_areas;
+        shown_indicator = output;
+    } else {
+        cairo_surface_destroy(output);
+    }
     return bg_pixmap;
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Determines the smallest rectangle containing all pixels in which the two
+ * images (of the same size) differ. Returns false if they are identical.
+ *
+ */
+static bool indicator_damage(cairo_surface_t *before, cairo_surface_t *after, Rect *damage) {
+    const int width = cairo_image_surface_get_width(after);
+    const int height = cairo_image_surface_get_height(after);
+    const int stride = cairo_image_surface_get_stride(after);
+    const unsigned char *a = cairo_image_surface_get_data(before);
+    const unsigned char *b = cairo_image_surface_get_data(after);
+    int x1 = width, y1 = height, x2 = -1, y2 = -1;
+
+    for (int y = 0; y < height; y++) {
+        const uint32_t *ra = (const uint32_t *)(a + y * stride);
+        const uint32_t *rb = (const uint32_t *)(b + y * stride);
+        if (memcmp(ra, rb, width * 4) == 0)
+            continue;
+        for (int x = 0; x < width; x++) {
+            if (ra[x] == rb[x])
+                continue;
+            if (x < x1)
+                x1 = x;
+            if (x > x2)
+                x2 = x;
+        }
+        if (y1 == height)
+            y1 = y;
+        y2 = y;
+    }
+    if (x2 < 0)
+        return false;
+
+    damage->x = x1;
+    damage->y = y1;
+    damage->width = x2 - x1 + 1;
+    damage->height = y2 - y1 + 1;
+    return true;
+}
+
+/*
+ * Redraws only the rectangle of the unlock indicator which changed since it
+ * was last drawn (--low-bandwidth): the background is restored there from
+ * background_pixmap and the indicator is drawn on top, so that no image is
+ * sent to the X server. Returns false if the whole frame needs to be drawn.
+ *
+ */
+static bool redraw_indicator(void) {
+    if (shown_indicator == NULL ||
+        frame_resolution[0] != root_resolution[0] ||
+        frame_resolution[1] != root_resolution[1] ||
+        background_resolution[0] != root_resolution[0] ||
+        background_resolution[1] != root_resolution[1])
+        return false;
+
+    int button_diameter_physical = ceil(scaling_factor() * ICON_SIZE);
+    if (cairo_image_surface_get_width(shown_indicator) != button_diameter_physical)
+        return false;
+
+    const Rect *areas;
+    Rect fallback;
+    int num_areas = screen_areas(&areas, &fallback);
+    if (num_areas != shown_num_areas ||
+        memcmp(areas, shown_areas, num_areas * sizeof(Rect)) != 0)
+        return false;
+
+    /* Rendering the indicator locally is cheap, and tells what changed. */
+    cairo_surface_t *output = render_indicator(button_diameter_physical);
+    Rect damage;
+    if (!indicator_damage(shown_indicator, output, &damage)) {
+        cairo_surface_destroy(output);
+        DEBUG("redraw_indicator: unchanged\n");
+        return true;
+    }
+    cairo_surface_destroy(shown_indicator);
+    shown_indicator = output;
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(draw_conn, frame_pixmap, vistype, frame_resolution[0], frame_resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+    xcb_change_window_attributes(draw_conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){frame_pixmap});
+
+    for (int i = 0; i < num_areas; i++) {
+        int x = (areas[i].x + ((areas[i].width / 2) - (button_diameter_physical / 2)));
+        int y = (areas[i].y + ((areas[i].height / 2) - (button_diameter_physical / 2)));
+        xcb_copy_area(draw_conn, background_pixmap, frame_pixmap, background_gc,
+                      x + damage.x, y + damage.y, x + damage.x, y + damage.y,
+                      damage.width, damage.height);
+        /* The copy above was sent behind cairo’s back. */
+        cairo_surface_mark_dirty(xcb_output);
+
+        cairo_save(xcb_ctx);
+        cairo_rectangle(xcb_ctx, x + damage.x, y + damage.y, damage.width, damage.height);
+        cairo_clip(xcb_ctx);
+        cairo_save(xcb_ctx);
+        cairo_translate(xcb_ctx, x, y);
+        draw_indicator(xcb_ctx);
+        cairo_restore(xcb_ctx);
+        /* In case the text overlaps the indicator. */
+        text_draw(xcb_ctx, &areas[i], button_diameter_physical, scaling_factor());
+        cairo_restore(xcb_ctx);
+        cairo_surface_flush(xcb_output);
+
+        xcb_clear_area(draw_conn, 0, win, x + damage.x, y + damage.y, damage.width, damage.height);
+    }
+
+    cairo_destroy(xcb_ctx);
+    cairo_surface_destroy(xcb_output);
+    DEBUG("redraw_indicator: %dx%d px at %d,%d\n", damage.width, damage.height, damage.x, damage.y);
+    return true;
+}
+
+static void draw_text_damage(void);
+
+/*
+ * Draws the frame for the current state and shows it: only what changed in
+ * the unlock indicator with --low-bandwidth, otherwise everything.
+ *
+ */
+static void draw_screen(void) {
+    DEBUG("draw_screen(unlock_state = %d, pam_state = %d)\n", state.unlock_state, state.pam_state);
+    frame_begin();
+    if (low_bandwidth && redraw_indicator()) {
+        /* The text is drawn separately. */
+        draw_text_damage();
+    } else {
+        xcb_pixmap_t bg_pixmap = draw_frame(root_resolution);
+        xcb_change_window_attributes(draw_conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
+        xcb_clear_area(draw_conn, 0, win, 0, 0, root_resolution[0], root_resolution[1]);
+    }
+    xcb_flush(draw_conn);
+    frame_end("redraw_screen");
+}
+
+/*
+ * Re-renders only the lines of text which changed (see text_set()), leaving
+ * the rest of the frame alone: their rectangles are restored from the
+ * background and the text is drawn on top.
+ *
+ */
+static void draw_text_damage(void) {
+    if (!text_dirty())
+        return;
+
+    int button_diameter_physical = ceil(scaling_factor() * ICON_SIZE);
+    const Rect *areas;
+    Rect fallback;
+    int num_areas = screen_areas(&areas, &fallback);
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(draw_conn, frame_pixmap, vistype, frame_resolution[0], frame_resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+    Rect damage[TEXT_COUNT];
+
+    /* The server might have copied the pixmap when it was set as the
+     * background, so set it again to make sure the changes are used. */
+    xcb_change_window_attributes(draw_conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){frame_pixmap});
+    int num_damaged = 0;
+
+    for (int i = 0; i < num_areas; i++) {
+        int n = text_damage(&areas[i], button_diameter_physical, scaling_factor(), damage);
+        if (n == 0)
+            continue;
+
+        cairo_save(xcb_ctx);
+        for (int r = 0; r < n; r++) {
+            xcb_copy_area(draw_conn, background_pixmap, frame_pixmap, background_gc,
+                          damage[r].x, damage[r].y, damage[r].x, damage[r].y,
+                          damage[r].width, damage[r].height);
+            cairo_rectangle(xcb_ctx, damage[r].x, damage[r].y, damage[r].width, damage[r].height);
+        }
+        /* The copies above were sent behind cairo’s back. */
+        cairo_surface_mark_dirty(xcb_output);
+        cairo_clip(xcb_ctx);
+        text_draw(xcb_ctx, &areas[i], button_diameter_physical, scaling_factor());
+        cairo_restore(xcb_ctx);
+        cairo_surface_flush(xcb_output);
+
+        for (int r = 0; r < n; r++)
+            xcb_clear_area(draw_conn, 0, win, damage[r].x, damage[r].y, damage[r].width, damage[r].height);
+        num_damaged += n;
+    }
+    text_mark_clean();
+
+    cairo_destroy(xcb_ctx);
+    cairo_surface_destroy(xcb_output);
+    DEBUG("redraw_text: %d rectangle(s)\n", num_damaged);
+}
+
+/*
+ * Re-renders only the lines of text which changed, see draw_text_damage().
+ *
+ */
+static void draw_text(void) {
+    /* The first frame will contain the text anyway. */
+    if (frame_pixmap == XCB_NONE || !text_dirty())
+        return;
+
+    frame_begin();
+    draw_text_damage();
+    xcb_flush(draw_conn);
+    frame_end("redraw_text");
+}
+
+/*******************************************************************************
+ * The render thread’s side, see render.c.
+ ******************************************************************************/
+
+/*
+ * Switches to the given connection, on which the render thread draws from
+ * now on. The resources created so far can be used from any connection, but
+ * cairo surfaces belong to the connection they were created on.
+ *
+ */
+void render_attach(xcb_connection_t *new_conn) {
+    if (indicator_surface != NULL) {
+        cairo_surface_destroy(indicator_surface);
+        indicator_surface = NULL;
+    }
+    draw_conn = new_conn;
+}
+
+/*
+ * Applies the given command. Redraws are only noted, render_flush() draws
+ * once all pending commands were applied.
+ *
+ */
+void render_execute(const render_msg_t *msg) {
+    if (draw_conn == NULL)
+        draw_conn = conn;
+
+    switch (msg->command) {
+        case RENDER_REDRAW_SCREEN:
+            state = msg->u.state;
+            screen_pending = true;
+            break;
+        case RENDER_REDRAW_TEXT:
+            text_pending = true;
+            break;
+        case RENDER_SET_TEXT:
+            text_set(msg->u.text.line, msg->u.text.text);
+            break;
+        case RENDER_SET_SCREENS:
+            free(screen_rects);
+            screen_rects = msg->u.screens.areas;
+            num_screen_rects = msg->u.screens.num_areas;
+            root_resolution[0] = msg->u.screens.resolution[0];
+            root_resolution[1] = msg->u.screens.resolution[1];
+            discard_shown_indicator();
+            break;
+        case RENDER_SET_THEME:
+            free((theme_t *)theme);
+            theme = msg->u.theme.theme;
+            if (msg->u.theme.changes & THEME_CHANGED_BACKGROUND)
+                forget_background();
+            discard_shown_indicator();
+            break;
+        case RENDER_INVALIDATE_BACKGROUND:
+            forget_background();
+            break;
+        case RENDER_INVALIDATE_FRAME:
+            discard_shown_indicator();
+            break;
+        case RENDER_PREPARE_BACKGROUND:
+            /* Don’t let a key press wait for the upload. */
+            render_flush();
+            render_next_background(msg->u.image.image, msg->u.image.scale);
+            break;
+        case RENDER_SET_SOURCE:
+            use_background_source(msg->u.source.image, msg->u.source.scale,
+                                  msg->u.source.pixmap, msg->u.source.resolution);
+            break;
+        case RENDER_SWITCH_BACKGROUND:
+            use_next_background();
+            break;
+        case RENDER_UPDATE_BACKGROUND:
+            paint_background_frame(msg->u.image.image, msg->u.image.scale);
+            cairo_surface_destroy(msg->u.image.image);
+            break;
+    }
+}
+
+/*
+ * Draws what was requested since the last call, with the latest state.
+ *
+ */
+void render_flush(void) {
+    if (screen_pending)
+        draw_screen();
+    else if (text_pending)
+        draw_text();
+    screen_pending = false;
+    text_pending = false;
+}
+
+/*******************************************************************************
+ * The main thread’s side. These functions post commands (see render.h).
+ ******************************************************************************/
+
+/*
+ * Posts the resolution of the root window and the screens, if they changed
+ * since they were last posted.
+ *
+ */
+static void post_screens(void) {
+    if (posted_num_areas == xr_screens &&
+        posted_resolution[0] == last_resolution[0] &&
+        posted_resolution[1] == last_resolution[1] &&
+        (xr_screens == 0 || memcmp(posted_areas, xr_resolutions, xr_screens * sizeof(Rect)) == 0))
+        return;
+
+    render_msg_t msg = {.command = RENDER_SET_SCREENS};
+    Rect *copies[2] = {NULL, NULL};
+    for (int i = 0; i < 2 && xr_screens > 0; i++) {
+        if ((copies[i] = malloc(xr_screens * sizeof(Rect))) == NULL) {
+            /* No memory? Just keep on using the old information. */
+            free(copies[0]);
+            return;
+        }
+        memcpy(copies[i], xr_resolutions, xr_screens * sizeof(Rect));
+    }
+    free(posted_areas);
+    posted_areas = copies[0];
+    posted_num_areas = xr_screens;
+    posted_resolution[0] = last_resolution[0];
+    posted_resolution[1] = last_resolution[1];
+
+    msg.u.screens.areas = copies[1];
+    msg.u.screens.num_areas = xr_screens;
+    msg.u.screens.resolution[0] = last_resolution[0];
+    msg.u.screens.resolution[1] = last_resolution[1];
+    render_post(&msg);
+}
+
+/*
+ * Draws the first frame right away (there is no window yet, so it is only
+ * shown once the window is created with it) and returns the frame pixmap,
+ * which must not be freed by the caller. Only used before render_start().
+ *
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    if (draw_conn == NULL)
+        draw_conn = conn;
+    post_screens();
+    state.unlock_state = unlock_state;
+    state.pam_state = pam_state;
+    state.input_position = input_position;
+    state.caps_lock = (modifier_string != NULL);
+    return draw_frame(resolution);
+}
+
+/*
+ * Posts a redraw with the current state.
  *
  */
 void redraw_screen(void) {
-    DEBUG("redraw_screen(unlock_state = %d, pam_state = %d)\n", unlock_state, pam_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, bg_pixmap);
-    xcb_flush(conn);
+    /* The current state is drawn once the display is back, see
+     * display_on(). */
+    if (display_blanked)
+        return;
+
+    post_screens();
+    render_msg_t msg = {.command = RENDER_REDRAW_SCREEN};
+    msg.u.state.unlock_state = unlock_state;
+    msg.u.state.pam_state = pam_state;
+    msg.u.state.input_position = input_position;
+    msg.u.state.caps_lock = (modifier_string != NULL);
+    render_post(&msg);
+}
+
+/*
+ * Posts a redraw of the lines of text which changed (see set_text()).
+ *
+ */
+void redraw_text(void) {
+    if (display_blanked)
+        return;
+
+    render_msg_t msg = {.command = RENDER_REDRAW_TEXT};
+    render_post(&msg);
+}
+
+/*
+ * Sets the content of the given line of text (see text_set()). Lines longer
+ * than RENDER_TEXT_MAX bytes are cut off.
+ *
+ */
+void set_text(text_line_t line, const char *text) {
+    render_msg_t msg = {.command = RENDER_SET_TEXT};
+    msg.u.text.line = line;
+    snprintf(msg.u.text.text, sizeof(msg.u.text.text), "%s", (text != NULL ? text : ""));
+    render_post(&msg);
+}
+
+/*
+ * Replaces the theme, which the render thread frees once it no longer uses
+ * it. Returns what changed (see theme_diff()), 0 if nothing did, in which
+ * case new_theme is freed right away.
+ *
+ */
+unsigned int set_theme(theme_t *new_theme) {
+    if (posted_theme == NULL)
+        posted_theme = theme;
+
+    unsigned int changes = theme_diff(posted_theme, new_theme);
+    if (changes == 0) {
+        free(new_theme);
+        return 0;
+    }
+
+    render_msg_t msg = {.command = RENDER_SET_THEME};
+    msg.u.theme.theme = new_theme;
+    msg.u.theme.changes = changes;
+    posted_theme = new_theme;
+    render_post(&msg);
+    return changes;
+}
+
+/*
+ * Makes the next redraw render the background again, see
+ * forget_background().
+ *
+ */
+void invalidate_background(void) {
+    render_msg_t msg = {.command = RENDER_INVALIDATE_BACKGROUND};
+    render_post(&msg);
+}
+
+/*
+ * Makes the next redraw_screen() draw the whole frame, even with
+ * --low-bandwidth.
+ *
+ */
+void invalidate_frame(void) {
+    render_msg_t msg = {.command = RENDER_INVALIDATE_FRAME};
+    render_post(&msg);
+}
+
+/*
+ * Sets what the background is rendered from: the given image (see images.c),
+ * of which the caller keeps its own reference, or the given pixmap (a copy
+ * of the wallpaper with the given resolution), which is handed over. The
+ * image is uploaded to the X server once and released by the render thread
+ * (so it is freed once the caller drops its reference), and the upload or
+ * the pixmap is kept, so that the background can be rendered again when the
+ * resolution or the background color changes.
+ *
+ */
+void set_background_source(cairo_surface_t *image, double scale, xcb_pixmap_t pixmap, uint32_t *resolution) {
+    render_msg_t msg = {.command = RENDER_SET_SOURCE};
+    msg.u.source.image = (image != NULL ? cairo_surface_reference(image) : NULL);
+    msg.u.source.scale = scale;
+    msg.u.source.pixmap = pixmap;
+    msg.u.source.resolution[0] = resolution[0];
+    msg.u.source.resolution[1] = resolution[1];
+    render_post(&msg);
+}
+
+/*
+ * Renders the given image (see images.c) into the background which is
+ * switched to on the next switch_background(). The caller still owns the
+ * image, which is no longer needed afterwards.
+ *
+ */
+void prepare_next_background(cairo_surface_t *image, double scale) {
+    post_screens();
+    render_msg_t msg = {.command = RENDER_PREPARE_BACKGROUND};
+    msg.u.image.image = cairo_surface_reference(image);
+    msg.u.image.scale = scale;
+    next_background_posted = true;
+    render_post(&msg);
+}
+
+/*
+ * Whether a background was prepared, see prepare_next_background().
+ *
+ */
+bool next_background_ready(void) {
+    return next_background_posted;
+}
+
+/*
+ * Switches to the prepared background, if any, without touching the image
+ * again. Returns false if there is none. The caller redraws.
+ *
+ */
+bool switch_background(void) {
+    if (!next_background_posted)
+        return false;
+
+    render_msg_t msg = {.command = RENDER_SWITCH_BACKGROUND};
+    next_background_posted = false;
+    render_post(&msg);
+    return true;
+}
+
+/*
+ * Paints the given image (a frame of an animation, see animation.c) onto the
+ * current background, instead of rendering a new one. The caller redraws.
+ *
+ */
+void update_background(cairo_surface_t *image, double scale) {
+    render_msg_t msg = {.command = RENDER_UPDATE_BACKGROUND};
+    msg.u.image.image = cairo_surface_reference(image);
+    msg.u.image.scale = scale;
+    render_post(&msg);
 }
 
 /*
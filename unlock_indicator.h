@@ -1,6 +1,11 @@
 #ifndef _UNLOCK_INDICATOR_H
 #define _UNLOCK_INDICATOR_H
 
+#include <stdint.h>
+
+#include "text.h"
+#include "theme.h"
+
 typedef enum {
     STATE_STARTED = 0,         /* default state */
     STATE_KEY_PRESSED = 1,     /* key was pressed, show unlock indicator */
@@ -13,11 +18,32 @@ typedef enum {
 typedef enum {
     STATE_PAM_IDLE = 0,   /* no PAM interaction at the moment */
     STATE_PAM_VERIFY = 1, /* currently verifying the password via PAM */
-    STATE_PAM_WRONG = 2   /* the password was wrong */
+    STATE_PAM_WRONG = 2,  /* the password was wrong */
+    STATE_PAM_TIMEOUT = 3 /* PAM did not answer within --auth-timeout */
 } pam_state_t;
 
+/* How many bytes were sent to the X server to draw the frames. */
+typedef struct {
+    unsigned long frames;
+    uint64_t last_bytes;
+    uint64_t max_bytes;
+    uint64_t total_bytes;
+} frame_stats_t;
+
 xcb_pixmap_t draw_image(uint32_t* resolution);
 void redraw_screen(void);
+void redraw_text(void);
+void set_text(text_line_t line, const char *text);
+unsigned int set_theme(theme_t *new_theme);
+void invalidate_background(void);
+void invalidate_frame(void);
+cairo_format_t screen_format(xcb_connection_t *conn, xcb_screen_t *scr);
+frame_stats_t frame_stats(void);
+void set_background_source(cairo_surface_t *image, double scale, xcb_pixmap_t pixmap, uint32_t *resolution);
+void prepare_next_background(cairo_surface_t *image, double scale);
+bool next_background_ready(void);
+bool switch_background(void);
+void update_background(cairo_surface_t *image, double scale);
 void clear_indicator(void);
 
 #endif
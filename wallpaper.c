@@ -1,11 +1,28 @@
 #include "wallpaper.h"
 
+static xcb_intern_atom_cookie_t atom_cookie;
+static int atom_requested = 0;
+
+/*
+ * Sends the InternAtom request for _XROOTPMAP_ID, so that its reply is
+ * already there when get_root_pixmap() needs it.
+ */
+void prefetch_root_pixmap_atom(xcb_connection_t* conn)
+{
+	atom_cookie = xcb_intern_atom(conn, 0, 13, "_XROOTPMAP_ID");
+	atom_requested = 1;
+}
+
 xcb_pixmap_t get_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen)
 {
-	xcb_intern_atom_cookie_t atom_cookie =
-		xcb_intern_atom(conn, 0, 13, "_XROOTPMAP_ID");
+	if (!atom_requested)
+		prefetch_root_pixmap_atom(conn);
+	atom_requested = 0;
+
 	xcb_intern_atom_reply_t* atom_reply =
 		xcb_intern_atom_reply(conn, atom_cookie, NULL);
+	if (atom_reply == NULL)
+		return XCB_NONE;
 	xcb_atom_t atom = atom_reply->atom;
 	free(atom_reply);
 
@@ -13,6 +30,14 @@ xcb_pixmap_t get_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen)
 		xcb_get_property(conn, 0, screen->root, atom, XCB_ATOM_PIXMAP, 0, 1);
 	xcb_get_property_reply_t* reply =
 		xcb_get_property_reply(conn, cookie, NULL);
+	if (reply == NULL)
+		return XCB_NONE;
+
+	/* No wallpaper was set (by a program which sets _XROOTPMAP_ID). */
+	if (xcb_get_property_value_length(reply) < (int)sizeof(xcb_pixmap_t)) {
+		free(reply);
+		return XCB_NONE;
+	}
 
 	xcb_pixmap_t pixmap = *((xcb_pixmap_t*) xcb_get_property_value(reply));
 	free(reply);
@@ -23,6 +48,8 @@ xcb_pixmap_t get_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen)
 xcb_pixmap_t copy_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen)
 {
 	xcb_pixmap_t root_pixmap = get_root_pixmap(conn, screen);
+	if (root_pixmap == XCB_NONE)
+		return XCB_NONE;
 
 	xcb_pixmap_t pixmap = xcb_generate_id(conn);
 	xcb_create_pixmap(conn, screen->root_depth, pixmap, screen->root,
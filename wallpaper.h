@@ -4,6 +4,7 @@
 #include <xcb/xcb.h>
 #include <stdlib.h>
 
+void prefetch_root_pixmap_atom(xcb_connection_t* conn);
 xcb_pixmap_t get_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen);
 xcb_pixmap_t copy_root_pixmap(xcb_connection_t* conn, xcb_screen_t* screen);
 
@@ -8,9 +8,10 @@
  *
  */
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
-#include <xcb/xcb_aux.h>
+#include <xcb/composite.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -18,8 +19,15 @@
 #include <unistd.h>
 #include <assert.h>
 #include <err.h>
+#include <ev.h>
 
+#include "i3lock.h"
+#include "xcb.h"
 #include "cursors.h"
+#include "timing.h"
+
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
@@ -48,17 +56,6 @@ static unsigned char mask_windows_bits[] = {
     0xf7, 0x00, 0xf3, 0x00, 0xe1, 0x01, 0xe0, 0x01, 0xc0, 0x03, 0xc0, 0x03,
     0x80, 0x01};
 
-static uint32_t get_colorpixel(char *hex) {
-    char strgroups[3][3] = {{hex[0], hex[1], '\0'},
-                            {hex[2], hex[3], '\0'},
-                            {hex[4], hex[5], '\0'}};
-    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                         (strtol(strgroups[1], NULL, 16)),
-                         (strtol(strgroups[2], NULL, 16))};
-
-    return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
-}
-
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
     xcb_visualtype_t *visual_type = NULL;
     xcb_depth_iterator_t depth_iter;
@@ -81,7 +78,35 @@ xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
     return NULL;
 }
 
-xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color) {
+/*
+ * Scales the given component (0.0 – 1.0) to the bits of the given mask.
+ *
+ */
+static uint32_t mask_component(uint32_t mask, double value) {
+    if (mask == 0)
+        return 0;
+    int shift = 0;
+    while (((mask >> shift) & 1) == 0)
+        shift++;
+    uint32_t max = mask >> shift;
+    return ((uint32_t)(value * max + 0.5) << shift) & mask;
+}
+
+/*
+ * Returns the pixel value of the given color in the given (root) visual, for
+ * core requests like CreateWindow or PolyFillRectangle. Works for any
+ * TrueColor visual (e.g. 16 or 30 bit), others get the 0xrrggbb value.
+ *
+ */
+uint32_t color_pixel(xcb_visualtype_t *visual, const color_t *color) {
+    if (visual == NULL || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR)
+        return color->pixel;
+    return mask_component(visual->red_mask, color->red) |
+           mask_component(visual->green_mask, color->green) |
+           mask_component(visual->blue_mask, color->blue);
+}
+
+xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, uint32_t pixel) {
     xcb_pixmap_t bg_pixmap = xcb_generate_id(conn);
     xcb_create_pixmap(conn, scr->root_depth, bg_pixmap, scr->root,
                       resolution[0], resolution[1]);
@@ -89,7 +114,7 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     /* Generate a Graphics Context and fill the pixmap with background color
      * (for images that are smaller than your screen) */
     xcb_gcontext_t gc = xcb_generate_id(conn);
-    uint32_t values[] = {get_colorpixel(color)};
+    uint32_t values[] = {pixel};
     xcb_create_gc(conn, gc, bg_pixmap, XCB_GC_FOREGROUND, values);
     xcb_rectangle_t rect = {0, 0, resolution[0], resolution[1]};
     xcb_poly_fill_rectangle(conn, bg_pixmap, gc, 1, &rect);
@@ -98,14 +123,65 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32
     return bg_pixmap;
 }
 
-xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap) {
+/* The atom used by open_fullscreen_window(), requested ahead of time by
+ * prefetch_window_atoms(). */
+static xcb_intern_atom_cookie_t bypass_atom_cookie;
+static bool bypass_atom_requested = false;
+
+/* What composite_overlay_acquire() needs, gathered ahead of time so that
+ * locking costs no round trip: whether a compositor runs (the owner of the
+ * _NET_WM_CM_Sn selection, watched for DestroyNotify) and, while it does, the
+ * overlay window, which we keep a reference to. */
+static struct {
+    xcb_intern_atom_cookie_t atom_cookie;
+    bool atom_requested;
+    xcb_atom_t atom;
+    xcb_get_selection_owner_cookie_t owner_cookie;
+    bool owner_requested;
+    xcb_window_t owner;
+    xcb_void_cookie_t watch_cookie;
+    bool watch_pending;
+    xcb_composite_get_overlay_window_cookie_t overlay_cookie;
+    bool overlay_requested;
+    xcb_window_t overlay;
+    /* Whether the lock window is a child of the overlay window. */
+    bool in_use;
+} cm = {.atom = XCB_NONE, .owner = XCB_NONE, .overlay = XCB_NONE};
+
+/*
+ * Sends the InternAtom requests for the atoms the lock window needs, so that
+ * their replies are already there when the window is created. With
+ * composite_overlay, also prefetches the Composite extension and the atom
+ * whose selection is owned by the running compositor (_NET_WM_CM_Sn).
+ *
+ */
+void prefetch_window_atoms(xcb_connection_t *conn, xcb_screen_t *scr, bool composite_overlay) {
+    bypass_atom_cookie = xcb_intern_atom(conn, 0, strlen("_NET_WM_BYPASS_COMPOSITOR"), "_NET_WM_BYPASS_COMPOSITOR");
+    bypass_atom_requested = true;
+    if (!composite_overlay)
+        return;
+
+    int screen_number = 0;
+    for (xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(conn));
+         it.rem > 0 && it.data->root != scr->root;
+         xcb_screen_next(&it))
+        screen_number++;
+
+    char name[32];
+    snprintf(name, sizeof(name), "_NET_WM_CM_S%d", screen_number);
+    cm.atom_cookie = xcb_intern_atom(conn, 0, strlen(name), name);
+    cm.atom_requested = true;
+    xcb_prefetch_extension_data(conn, &xcb_composite_id);
+}
+
+xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, uint32_t pixel, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
     uint32_t values[3];
     xcb_window_t win = xcb_generate_id(conn);
 
     if (pixmap == XCB_NONE) {
         mask |= XCB_CW_BACK_PIXEL;
-        values[0] = get_colorpixel(color);
+        values[0] = pixel;
     } else {
         mask |= XCB_CW_BACK_PIXMAP;
         values[0] = pixmap;
@@ -114,12 +190,10 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     mask |= XCB_CW_OVERRIDE_REDIRECT;
     values[1] = 1;
 
+    /* Exposures are handled by the server (the window has a background
+     * pixmap) and key releases are tracked by XKB, so we don’t select them. */
     mask |= XCB_CW_EVENT_MASK;
-    values[2] = XCB_EVENT_MASK_EXPOSURE |
-                XCB_EVENT_MASK_KEY_PRESS |
-                XCB_EVENT_MASK_KEY_RELEASE |
-                XCB_EVENT_MASK_VISIBILITY_CHANGE |
-                XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    values[2] = LOCK_WINDOW_EVENT_MASK;
 
     xcb_create_window(conn,
                       XCB_COPY_FROM_PARENT,
@@ -144,75 +218,451 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
                         strlen(name),
                         name);
 
-    /* Map the window (= make it visible) */
-    xcb_map_window(conn, win);
+    /* Ask the compositor (if any) not to redirect the lock window, so that
+     * frames are shown right away instead of after the next composite pass. */
+    if (bypass_atom_requested) {
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(conn, bypass_atom_cookie, NULL);
+        bypass_atom_requested = false;
+        if (reply != NULL) {
+            uint32_t bypass = 1;
+            xcb_change_property(conn,
+                                XCB_PROP_MODE_REPLACE,
+                                win,
+                                reply->atom,
+                                XCB_ATOM_CARDINAL,
+                                32,
+                                1,
+                                &bypass);
+            free(reply);
+        }
+    }
+
+    return win;
+}
+
+/*
+ * Asks who owns the compositor selection, the reply is looked at by
+ * composite_overlay_update().
+ *
+ */
+static void request_compositor(xcb_connection_t *conn) {
+    if (cm.atom == XCB_NONE || cm.owner_requested)
+        return;
+    cm.owner_cookie = xcb_get_selection_owner(conn, cm.atom);
+    cm.owner_requested = true;
+}
+
+/*
+ * Negotiates Composite 0.3 (needed for GetOverlayWindow) and asks whether a
+ * compositor is running. Only waits for the replies of prefetch_window_atoms(),
+ * so it is meant to be called once a round trip happened since, e.g. after
+ * loading the keymap.
+ *
+ */
+void composite_overlay_init(xcb_connection_t *conn) {
+    if (!cm.atom_requested)
+        return;
+    xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(conn, cm.atom_cookie, NULL);
+    cm.atom_requested = false;
+    if (reply == NULL)
+        return;
+
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_composite_id);
+    if (extension == NULL || !extension->present) {
+        DEBUG("Composite extension not available, not using the overlay window\n");
+        free(reply);
+        return;
+    }
+    cm.atom = reply->atom;
+    free(reply);
+
+    /* The server remembers the version we asked for, the reply tells us
+     * nothing we need. */
+    xcb_discard_reply(conn, xcb_composite_query_version(conn, 0, 3).sequence);
+    request_compositor(conn);
+}
+
+/*
+ * Looks at the reply of the last selection owner request, if any. When a
+ * compositor is running, requests the overlay window (unless we already have
+ * it) and starts watching the compositor’s selection window, so that we learn
+ * when it goes away, see composite_overlay_handle_destroy().
+ *
+ */
+void composite_overlay_update(xcb_connection_t *conn, xcb_screen_t *scr) {
+    if (!cm.owner_requested)
+        return;
+    xcb_get_selection_owner_reply_t *reply = xcb_get_selection_owner_reply(conn, cm.owner_cookie, NULL);
+    cm.owner_requested = false;
+    xcb_window_t owner = (reply != NULL ? reply->owner : XCB_NONE);
+    free(reply);
+    if (owner == XCB_NONE) {
+        DEBUG("no compositor running, not using the overlay window\n");
+        return;
+    }
+
+    if (owner != cm.owner) {
+        cm.owner = owner;
+        if (cm.watch_pending)
+            xcb_discard_reply(conn, cm.watch_cookie.sequence);
+        /* Checked, in case the compositor is gone already. */
+        cm.watch_cookie = xcb_change_window_attributes_checked(conn, owner, XCB_CW_EVENT_MASK,
+                                                               (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+        cm.watch_pending = true;
+    }
+    if (cm.overlay == XCB_NONE && !cm.overlay_requested) {
+        cm.overlay_cookie = xcb_composite_get_overlay_window(conn, scr->root);
+        cm.overlay_requested = true;
+    }
+}
+
+/*
+ * Gives up our reference to the overlay window, which the server unmaps once
+ * nobody holds one.
+ *
+ */
+static void release_overlay(xcb_connection_t *conn, xcb_screen_t *scr) {
+    /* A GetOverlayWindow still in flight takes a reference, too. */
+    if (cm.overlay_requested) {
+        xcb_discard_reply(conn, cm.overlay_cookie.sequence);
+        cm.overlay_requested = false;
+    } else if (cm.overlay == XCB_NONE) {
+        return;
+    }
+    xcb_composite_release_overlay_window(conn, scr->root);
+    cm.overlay = XCB_NONE;
+}
 
-    /* Raise window (put it on top) */
-    values[0] = XCB_STACK_MODE_ABOVE;
+/*
+ * Moves the (unmapped) lock window into the composite overlay window, which
+ * the server always shows above all other windows and never redirects. The
+ * compositor paints into the overlay window, but its children are drawn on
+ * top, so frames reach the screen without going through the compositor and
+ * no compositor overlay can end up above the lock window.
+ *
+ * Only done if a compositor is running: otherwise, the overlay window would
+ * cover the screen. Returns the overlay window, or XCB_NONE. The replies
+ * needed were requested while unlocked (see composite_overlay_update()), so
+ * this usually does not wait; only the first lock after a compositor started
+ * waits for GetOverlayWindow.
+ *
+ */
+xcb_window_t composite_overlay_acquire(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t win) {
+    composite_overlay_update(conn, scr);
+    if (cm.overlay_requested) {
+        xcb_composite_get_overlay_window_reply_t *reply =
+            xcb_composite_get_overlay_window_reply(conn, cm.overlay_cookie, NULL);
+        cm.overlay_requested = false;
+        if (reply == NULL) {
+            DEBUG("could not get the composite overlay window\n");
+            return XCB_NONE;
+        }
+        cm.overlay = reply->overlay_win;
+        free(reply);
+    }
+    /* Sent before GetOverlayWindow, so this does not wait either. */
+    if (cm.watch_pending) {
+        xcb_generic_error_t *error = xcb_request_check(conn, cm.watch_cookie);
+        cm.watch_pending = false;
+        if (error != NULL) {
+            DEBUG("the compositor exited\n");
+            free(error);
+            cm.owner = XCB_NONE;
+            release_overlay(conn, scr);
+            request_compositor(conn);
+        }
+    }
+    if (cm.overlay == XCB_NONE || cm.owner == XCB_NONE)
+        return XCB_NONE;
+
+    /* The window is unmapped, so no redraw of the render thread depends on
+     * the reparent being processed first. */
+    xcb_reparent_window(conn, win, cm.overlay, 0, 0);
+    cm.in_use = true;
+    return cm.overlay;
+}
+
+/*
+ * Moves the (unmapped) lock window back to the root window, see
+ * composite_overlay_acquire(). The overlay window is kept as long as the
+ * compositor runs (it keeps the overlay window mapped anyway), so that the
+ * next lock does not have to get it again.
+ *
+ */
+void composite_overlay_release(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t win) {
+    xcb_reparent_window(conn, win, scr->root, 0, 0);
+    cm.in_use = false;
+    if (cm.owner == XCB_NONE) {
+        release_overlay(conn, scr);
+        /* In case a compositor starts before the next lock. */
+        request_compositor(conn);
+    }
+    xcb_flush(conn);
+}
+
+/*
+ * Handles a DestroyNotify: when it is about the compositor’s selection window,
+ * the compositor exited, and our reference would keep the overlay window
+ * covering the screen, so it is released (once the lock window is out of it).
+ *
+ */
+void composite_overlay_handle_destroy(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t window) {
+    if (window == XCB_NONE || window != cm.owner)
+        return;
+    DEBUG("the compositor exited\n");
+    cm.owner = XCB_NONE;
+    if (cm.in_use)
+        return;
+    release_overlay(conn, scr);
+    request_compositor(conn);
+    xcb_flush(conn);
+}
+
+/*
+ * Waits until the server has processed all requests sent so far on the given
+ * connection. X does not order requests of different clients, so this is
+ * needed before the render connection (see render.c) uses what was created
+ * or changed on the main connection.
+ *
+ */
+void sync_with_server(xcb_connection_t *conn) {
+    free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+}
+
+/*
+ * Maps the lock window (= makes it visible) and puts it on top.
+ *
+ */
+void map_lock_window(xcb_connection_t *conn, xcb_window_t win) {
+    uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+
+    xcb_map_window(conn, win);
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* Send the requests right away, but don’t wait for the server to process
+     * them: all following requests refer to the window anyway, so the server
+     * processes them in order. Waiting would only add a round trip. */
+    xcb_flush(conn);
+}
 
-    return win;
+/*
+ * While the display is blanked, we only need to notice key presses (which
+ * wake it up) and configuration changes. Visibility changes are ignored until
+ * the display is back, see map_lock_window().
+ *
+ */
+void set_lock_window_blanked(xcb_connection_t *conn, xcb_window_t win, bool blanked) {
+    uint32_t values[] = {blanked ? (XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_STRUCTURE_NOTIFY)
+                                 : LOCK_WINDOW_EVENT_MASK};
+    xcb_change_window_attributes(conn, win, XCB_CW_EVENT_MASK, values);
+    xcb_flush(conn);
 }
 
 /*
- * Repeatedly tries to grab pointer and keyboard (up to 1000 times).
+ * Selects MIT-SCREEN-SAVER notifications (sent when the screen saver, which
+ * blanks the display, turns on or off). Returns false if the extension is not
+ * available.
  *
  */
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
-    xcb_grab_pointer_cookie_t pcookie;
-    xcb_grab_pointer_reply_t *preply;
+bool screensaver_select_input(xcb_connection_t *conn, xcb_screen_t *screen, uint8_t *first_event) {
+    const xcb_query_extension_reply_t *extension = xcb_get_extension_data(conn, &xcb_screensaver_id);
+    if (extension == NULL || !extension->present)
+        return false;
+
+    *first_event = extension->first_event;
+    xcb_screensaver_select_input(conn, screen->root, XCB_SCREENSAVER_EVENT_NOTIFY_MASK);
+    return true;
+}
 
+/*
+ * Releases the grabs and unmaps the lock window, used by --daemon to go back
+ * to standby after unlocking.
+ *
+ */
+void unmap_lock_window(xcb_connection_t *conn, xcb_window_t win) {
+    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    xcb_unmap_window(conn, win);
+    xcb_flush(conn);
+}
+
+/* Grabbing is retried with exponential backoff, starting at GRAB_BACKOFF_MIN
+ * and doubling up to GRAB_BACKOFF_MAX seconds between attempts, until
+ * GRAB_TIMEOUT seconds have passed. */
+#define GRAB_BACKOFF_MIN 0.001
+#define GRAB_BACKOFF_MAX 0.064
+#define GRAB_TIMEOUT 5.0
+
+/* State of the grab which is currently being acquired, see
+ * grab_pointer_and_keyboard(). */
+static struct {
+    bool active;
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+    xcb_cursor_t cursor;
+    grab_done_callback_t done;
+
+    bool pointer_grabbed;
+    bool keyboard_grabbed;
+    /* Whether a reply to the last grab request is still outstanding. */
+    bool pointer_pending;
+    bool keyboard_pending;
+    xcb_grab_pointer_cookie_t pcookie;
     xcb_grab_keyboard_cookie_t kcookie;
-    xcb_grab_keyboard_reply_t *kreply;
 
-    int tries = 10000;
+    int attempts;
+    double backoff;
+    double started;
+    struct ev_timer *retry_timer;
+} grab;
+
+/*
+ * Sends grab requests for whatever is not grabbed yet. Both requests are
+ * sent together, so each attempt costs at most a single round trip.
+ *
+ */
+static void grab_send(void) {
+    grab.attempts++;
 
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
+    if (!grab.pointer_grabbed) {
+        grab.pcookie = xcb_grab_pointer(
+            grab.conn,
             false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
+            grab.screen->root,   /* grab the root window */
             XCB_NONE,            /* which events to let through */
             XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
             XCB_GRAB_MODE_ASYNC, /* keyboard mode */
             XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
+            grab.cursor,         /* we change the cursor to whatever the user wanted */
             XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
-        }
-
-        /* Make this quite a bit slower */
-        usleep(50);
+        grab.pointer_pending = true;
     }
 
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
+    if (!grab.keyboard_grabbed) {
+        grab.kcookie = xcb_grab_keyboard(
+            grab.conn,
+            true,              /* report events */
+            grab.screen->root, /* grab the root window */
             XCB_CURRENT_TIME,
             XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
             XCB_GRAB_MODE_ASYNC);
+        grab.keyboard_pending = true;
+    }
 
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
+    xcb_flush(grab.conn);
+}
+
+static void grab_retry_cb(EV_P_ ev_timer *w, int revents) {
+    grab_send();
+}
+
+static void grab_finish(bool success) {
+    grab.active = false;
+    ev_timer_stop(main_loop, grab.retry_timer);
+
+    if (success)
+        DEBUG("grabbed pointer and keyboard after %d attempt(s) in %.1f ms\n",
+              grab.attempts, now_ms() - grab.started);
+    else
+        fprintf(stderr, "[i3lock] could not grab pointer/keyboard after %d attempt(s) in %.1f ms\n",
+                grab.attempts, now_ms() - grab.started);
+
+    grab.done(success);
+}
+
+/*
+ * Starts grabbing pointer and keyboard without blocking: the replies are
+ * collected by grab_poll(), failed attempts are retried from the event loop
+ * with capped exponential backoff. Once both grabs are held (or
+ * GRAB_TIMEOUT passed), done is called.
+ *
+ */
+void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, grab_done_callback_t done) {
+    if (grab.retry_timer == NULL) {
+        grab.retry_timer = calloc(sizeof(struct ev_timer), 1);
+        ev_init(grab.retry_timer, grab_retry_cb);
+    }
 
-        /* Make this quite a bit slower */
-        usleep(50);
+    grab.active = true;
+    grab.conn = conn;
+    grab.screen = screen;
+    grab.cursor = cursor;
+    grab.done = done;
+    grab.pointer_grabbed = false;
+    grab.keyboard_grabbed = false;
+    grab.attempts = 0;
+    grab.backoff = GRAB_BACKOFF_MIN;
+    grab.started = now_ms();
+
+    grab_send();
+}
+
+/*
+ * Collects the replies to the outstanding grab requests (if any) and
+ * schedules the next attempt if necessary. Needs to be called whenever data
+ * was read from the X11 connection.
+ *
+ */
+void grab_poll(void) {
+    void *reply;
+
+    if (!grab.active)
+        return;
+
+    if (grab.pointer_pending &&
+        xcb_poll_for_reply(grab.conn, grab.pcookie.sequence, &reply, NULL)) {
+        xcb_grab_pointer_reply_t *preply = reply;
+        grab.pointer_pending = false;
+        grab.pointer_grabbed = (preply && preply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(preply);
     }
 
-    if (tries <= 0)
-        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+    if (grab.keyboard_pending &&
+        xcb_poll_for_reply(grab.conn, grab.kcookie.sequence, &reply, NULL)) {
+        xcb_grab_keyboard_reply_t *kreply = reply;
+        grab.keyboard_pending = false;
+        grab.keyboard_grabbed = (kreply && kreply->status == XCB_GRAB_STATUS_SUCCESS);
+        free(kreply);
+    }
+
+    if (grab.pointer_pending || grab.keyboard_pending)
+        return;
+
+    if (grab.pointer_grabbed && grab.keyboard_grabbed) {
+        grab_finish(true);
+        return;
+    }
+
+    if (now_ms() - grab.started >= GRAB_TIMEOUT * 1000) {
+        grab_finish(false);
+        return;
+    }
+
+    /* Someone else (e.g. an open menu) holds a grab, try again later. */
+    ev_timer_set(grab.retry_timer, grab.backoff, 0.);
+    ev_timer_start(main_loop, grab.retry_timer);
+    grab.backoff *= 2;
+    if (grab.backoff > GRAB_BACKOFF_MAX)
+        grab.backoff = GRAB_BACKOFF_MAX;
+}
+
+/*
+ * Stops acquiring the grabs, e.g. because the screen was unlocked already.
+ * Grabs which were acquired are not released, see unmap_lock_window().
+ *
+ */
+void grab_cancel(void) {
+    if (!grab.active)
+        return;
+
+    grab.active = false;
+    ev_timer_stop(main_loop, grab.retry_timer);
+    if (grab.pointer_pending)
+        xcb_discard_reply(grab.conn, grab.pcookie.sequence);
+    if (grab.keyboard_pending)
+        xcb_discard_reply(grab.conn, grab.kcookie.sequence);
+    grab.pointer_pending = false;
+    grab.keyboard_pending = false;
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -1,16 +1,40 @@
 #ifndef _XCB_H
 #define _XCB_H
 
+#include <stdbool.h>
 #include <xcb/xcb.h>
 #include <xcb/dpms.h>
+#include <xcb/screensaver.h>
+
+#include "theme.h"
+
+#define LOCK_WINDOW_EVENT_MASK (XCB_EVENT_MASK_KEY_PRESS |         \
+                                XCB_EVENT_MASK_VISIBILITY_CHANGE | \
+                                XCB_EVENT_MASK_STRUCTURE_NOTIFY)
 
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
-xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
-xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
+uint32_t color_pixel(xcb_visualtype_t *visual, const color_t *color);
+xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, uint32_t pixel);
+void prefetch_window_atoms(xcb_connection_t *conn, xcb_screen_t *scr, bool composite_overlay);
+xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, uint32_t pixel, xcb_pixmap_t pixmap);
+void composite_overlay_init(xcb_connection_t *conn);
+void composite_overlay_update(xcb_connection_t *conn, xcb_screen_t *scr);
+xcb_window_t composite_overlay_acquire(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t win);
+void composite_overlay_release(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t win);
+void composite_overlay_handle_destroy(xcb_connection_t *conn, xcb_screen_t *scr, xcb_window_t window);
+void sync_with_server(xcb_connection_t *conn);
+void map_lock_window(xcb_connection_t *conn, xcb_window_t win);
+void unmap_lock_window(xcb_connection_t *conn, xcb_window_t win);
+void set_lock_window_blanked(xcb_connection_t *conn, xcb_window_t win, bool blanked);
+bool screensaver_select_input(xcb_connection_t *conn, xcb_screen_t *screen, uint8_t *first_event);
+/* Called once grabbing finished, success is false if it timed out. */
+typedef void (*grab_done_callback_t)(bool success);
+void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, grab_done_callback_t done);
+void grab_poll(void);
+void grab_cancel(void);
 void dpms_set_mode(xcb_connection_t *conn, xcb_dpms_dpms_mode_t mode);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 
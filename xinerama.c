@@ -26,38 +26,64 @@ Rect *xr_resolutions;
 static bool xinerama_active;
 extern bool debug_mode;
 
+/* Requests sent by xinerama_init(), whose replies are only needed by the
+ * first call of xinerama_query_screens(). */
+static bool init_pending;
+static xcb_xinerama_is_active_cookie_t active_cookie;
+static xcb_xinerama_query_screens_cookie_t screens_cookie;
+
+/*
+ * Sends the requests to find out whether Xinerama is active and which screens
+ * there are, without waiting for the replies. The extension data should have
+ * been prefetched (xcb_prefetch_extension_data()) right after connecting.
+ *
+ */
 void xinerama_init(void) {
     if (!xcb_get_extension_data(conn, &xcb_xinerama_id)->present) {
         DEBUG("Xinerama extension not found, disabling.\n");
         return;
     }
 
-    xcb_xinerama_is_active_cookie_t cookie;
+    active_cookie = xcb_xinerama_is_active(conn);
+    screens_cookie = xcb_xinerama_query_screens_unchecked(conn);
+    init_pending = true;
+}
+
+/*
+ * Collects the reply to the IsActive request sent by xinerama_init().
+ *
+ */
+static void xinerama_finish_init(void) {
     xcb_xinerama_is_active_reply_t *reply;
 
-    cookie = xcb_xinerama_is_active(conn);
-    reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
+    init_pending = false;
+    reply = xcb_xinerama_is_active_reply(conn, active_cookie, NULL);
     if (!reply)
         return;
 
-    if (!reply->state) {
-        free(reply);
-        return;
-    }
-
-    xinerama_active = true;
+    xinerama_active = (reply->state != 0);
     free(reply);
 }
 
 void xinerama_query_screens(void) {
-    if (!xinerama_active)
-        return;
-
     xcb_xinerama_query_screens_cookie_t cookie;
     xcb_xinerama_query_screens_reply_t *reply;
     xcb_xinerama_screen_info_t *screen_info;
 
-    cookie = xcb_xinerama_query_screens_unchecked(conn);
+    if (init_pending) {
+        xinerama_finish_init();
+        /* The screens were already requested along with IsActive. */
+        cookie = screens_cookie;
+        if (!xinerama_active) {
+            xcb_discard_reply(conn, cookie.sequence);
+            return;
+        }
+    } else {
+        if (!xinerama_active)
+            return;
+        cookie = xcb_xinerama_query_screens_unchecked(conn);
+    }
+
     reply = xcb_xinerama_query_screens_reply(conn, cookie, NULL);
     if (!reply) {
         if (debug_mode)